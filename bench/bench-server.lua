@@ -0,0 +1,20 @@
+-- LuaRPC benchmark server
+--   lua bench-server.lua tcpip <port>
+--   lua bench-server.lua serial <device>
+
+require("rpc")
+
+local mode, address = ...
+
+function noop()
+end
+
+function echo(...)
+	return ...
+end
+
+if mode == "tcpip" then
+	rpc.server(tonumber(address))
+else
+	rpc.server(address)
+end
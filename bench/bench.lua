@@ -0,0 +1,134 @@
+-- LuaRPC benchmark client
+--   lua bench.lua tcpip <host> <port>
+--   lua bench.lua serial <device>
+--
+-- prints one JSON object with round trip latencies, calls per second and
+-- codec throughput. BENCH_CALLS sets the number of timed calls and
+-- BENCH_SECONDS the time spent on each codec measurement.
+
+require("rpc")
+
+local mode, address, port = ...
+local calls = tonumber(os.getenv("BENCH_CALLS")) or 10000
+local seconds = tonumber(os.getenv("BENCH_SECONDS")) or 0.5
+
+-- payloads
+
+local function wide_table()
+	local t = {}
+	for i = 1, 1000 do t["key" .. i] = i end
+	return t
+end
+
+local function deep_table()
+	local t = {leaf = true}
+	for i = 1, 100 do t = {depth = i, child = t} end
+	return t
+end
+
+local function number_array()
+	local t = {}
+	for i = 1, 100000 do t[i] = i * 0.5 end
+	return t
+end
+
+local function checksum(s)
+	local sum = 0
+	for i = 1, #s, 64 do sum = (sum * 31 + s:byte(i)) % 65521 end
+	return sum
+end
+
+local payloads = {
+	{ "small_args", { 42, "hello", true } },
+	{ "wide_table", wide_table() },
+	{ "deep_table", deep_table() },
+	{ "big_string", string.rep("0123456789abcdef", 65536) },
+	{ "number_array", number_array() },
+	{ "function", checksum },
+}
+
+-- measurements
+
+local function percentile(sorted, p)
+	return sorted[math.max(1, math.ceil(#sorted * p))]
+end
+
+local function latency(f, ...)
+	local times = {}
+	for i = 1, math.min(calls, 100) do f(...) end -- warm up
+	local start = rpc.clock()
+	for i = 1, calls do
+		local t = rpc.clock()
+		f(...)
+		times[i] = rpc.clock() - t
+	end
+	local total = rpc.clock() - start
+	table.sort(times)
+	return {
+		calls = calls,
+		calls_per_sec = calls / total,
+		p50_us = percentile(times, 0.5) * 1e6,
+		p90_us = percentile(times, 0.9) * 1e6,
+		p99_us = percentile(times, 0.99) * 1e6,
+		p999_us = percentile(times, 0.999) * 1e6,
+		max_us = times[#times] * 1e6,
+	}
+end
+
+local function throughput(f, arg, bytes)
+	local n, start = 0, rpc.clock()
+	repeat
+		f(arg)
+		n = n + 1
+	until rpc.clock() - start >= seconds
+	local elapsed = rpc.clock() - start
+	return { ops_per_sec = n / elapsed, mb_per_sec = n * bytes / elapsed / 1e6 }
+end
+
+local function codec()
+	local results = {}
+	for _, p in ipairs(payloads) do
+		local encoded = rpc.encode(p[2])
+		results[p[1]] = {
+			bytes = #encoded,
+			encode = throughput(rpc.encode, p[2], #encoded),
+			decode = throughput(rpc.decode, encoded, #encoded),
+		}
+	end
+	return results
+end
+
+-- output
+
+local function json(v)
+	local t = type(v)
+	if t == "table" then
+		local keys, out = {}, {}
+		for k in pairs(v) do keys[#keys + 1] = k end
+		table.sort(keys)
+		for _, k in ipairs(keys) do
+			out[#out + 1] = string.format("%q:%s", k, json(v[k]))
+		end
+		return "{" .. table.concat(out, ",") .. "}"
+	elseif t == "number" then
+		return string.format("%.6g", v)
+	else
+		return string.format("%q", tostring(v))
+	end
+end
+
+local slave, err
+if mode == "tcpip" then
+	slave, err = rpc.connect(address, tonumber(port))
+else
+	slave, err = rpc.connect(address)
+end
+assert(slave, err)
+
+local small = payloads[1][2]
+print(json({
+	mode = mode,
+	noop = latency(slave.noop),
+	small_args = latency(slave.echo, small[1], small[2], small[3]),
+	codec = codec(),
+}))
@@ -0,0 +1,76 @@
+// ptypair: make two pseudo terminals joined back to back, print the names of
+// their slave sides and copy bytes between them until killed. this stands in
+// for a null modem cable so the serial transport can be benchmarked.
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+
+static int open_pty( void )
+{
+  struct termios t;
+  int fd = posix_openpt( O_RDWR | O_NOCTTY );
+
+  if( fd < 0 || grantpt( fd ) != 0 || unlockpt( fd ) != 0 )
+  {
+    perror( "ptypair: unable to open pty" );
+    exit( 1 );
+  }
+
+  // raw mode, so nothing is echoed or translated before the port is set up
+  tcgetattr( fd, &t );
+  t.c_iflag &= ~( IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON );
+  t.c_oflag &= ~OPOST;
+  t.c_lflag &= ~( ECHO | ECHONL | ICANON | ISIG | IEXTEN );
+  t.c_cflag &= ~( CSIZE | PARENB );
+  t.c_cflag |= CS8;
+  tcsetattr( fd, TCSANOW, &t );
+
+  // hold the slave side open so the master doesn't hang up between users
+  if( open( ptsname( fd ), O_RDWR | O_NOCTTY ) < 0 )
+  {
+    perror( "ptypair: unable to open pty slave" );
+    exit( 1 );
+  }
+  printf( "%s\n", ptsname( fd ) );
+  return fd;
+}
+
+static void relay( int from, int to )
+{
+  char buffer[ 4096 ];
+  ssize_t n = read( from, buffer, sizeof( buffer ) );
+  char *p = buffer;
+
+  while( n > 0 )
+  {
+    ssize_t w = write( to, p, n );
+    if( w <= 0 )
+      exit( 1 );
+    p += w;
+    n -= w;
+  }
+}
+
+int main( void )
+{
+  struct pollfd fds[ 2 ];
+
+  fds[ 0 ].fd = open_pty();
+  fds[ 1 ].fd = open_pty();
+  fds[ 0 ].events = fds[ 1 ].events = POLLIN;
+  fflush( stdout );
+
+  for( ;; )
+  {
+    if( poll( fds, 2, -1 ) < 0 )
+      return 1;
+    if( fds[ 0 ].revents & POLLIN )
+      relay( fds[ 0 ].fd, fds[ 1 ].fd );
+    if( fds[ 1 ].revents & POLLIN )
+      relay( fds[ 1 ].fd, fds[ 0 ].fd );
+  }
+}
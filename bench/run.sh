@@ -0,0 +1,27 @@
+#!/bin/sh
+# run the benchmarks over loopback TCP and over a pty pair, printing one JSON
+# document. expects bench/tcpip/rpc.so, bench/serial/rpc.so and bench/ptypair,
+# as built by "make bench".
+
+LUA=${LUA:-lua}
+PORT=${BENCH_PORT:-12347}
+
+cd "$(dirname "$0")" || exit 1
+
+echo '{"tcpip":'
+LUA_CPATH="./tcpip/?.so" $LUA bench-server.lua tcpip $PORT &
+server=$!
+sleep 1
+LUA_CPATH="./tcpip/?.so" $LUA bench.lua tcpip localhost $PORT
+kill $server
+
+echo ',"serial":'
+./ptypair > ptys &
+relay=$!
+sleep 1
+LUA_CPATH="./serial/?.so" $LUA bench-server.lua serial "$(sed -n 1p ptys)" &
+server=$!
+LUA_CPATH="./serial/?.so" $LUA bench.lua serial "$(sed -n 2p ptys)"
+kill $server $relay
+rm -f ptys
+echo '}'
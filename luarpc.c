@@ -14,15 +14,26 @@
 //  - port from Lua 4.x to 5.x
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <limits.h>
+#include <math.h>
+#include <errno.h>
+#include <time.h>
 #ifdef __MINGW32__
 void *alloca(size_t);
 #else
 #include <alloca.h>
 #endif
 
+#if defined( __SSSE3__ )
+#include <tmmintrin.h>
+#elif defined( __ARM_NEON )
+#include <arm_neon.h>
+#endif
+
 #include "lua.h"
 #include "lualib.h"
 #include "lauxlib.h"
@@ -87,6 +98,20 @@ static void rpcdebug (const char *msg, ...)
   abort();
 }
 
+// monotonic time in seconds
+static double rpc_clock( void )
+{
+#if defined( WIN32_BUILD )
+  return GetTickCount() / 1000.0;
+#elif defined( CLOCK_MONOTONIC )
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+  return ( double )time( NULL );
+#endif
+}
+
 // Lua Types
 enum {
   RPC_NIL=0,
@@ -97,7 +122,9 @@ enum {
   RPC_TABLE_END,
   RPC_FUNCTION,
   RPC_FUNCTION_END,
-  RPC_REMOTE
+  RPC_REMOTE,
+  RPC_BLOB,
+  RPC_NUMARRAY
 };
 
 // RPC Commands
@@ -106,7 +133,17 @@ enum
   RPC_CMD_CALL = 1,
   RPC_CMD_GET,
   RPC_CMD_CON,
-  RPC_CMD_NEWINDEX
+  RPC_CMD_NEWINDEX,
+  RPC_CMD_GETV,
+  RPC_CMD_INDEX,
+  RPC_CMD_NEXT,
+  RPC_CMD_LEN,
+  RPC_CMD_STREAM,
+  RPC_CMD_CHUNK,
+  RPC_CMD_DCALL,
+  RPC_CMD_CANCEL,
+  RPC_CMD_PING,
+  RPC_CMD_SUBSCRIBE
 };
 
 // RPC Status Codes
@@ -114,10 +151,15 @@ enum
 {
   RPC_READY = 64,
   RPC_UNSUPPORTED_CMD,
-  RPC_DONE
+  RPC_DONE,
+  RPC_PUSH,
+  RPC_NOTIFY
 };
 
-enum { RPC_PROTOCOL_VERSION = 3 };
+// subscribe command operations
+enum { SUB_OFF, SUB_ON, WATCH_OFF, WATCH_VALUE, WATCH_CHANGED };
+
+enum { RPC_PROTOCOL_VERSION = 4 };
 
 
 // return a string representation of an error number
@@ -131,7 +173,9 @@ static const char * errorString( int n )
     case ERR_COMMAND: return "undefined command";
     case ERR_NODATA: return "no data received when attempting to read";
     case ERR_HEADER: return "header exchanged failed";
-    case ERR_LONGFNAME: return "function name too long";
+    case ERR_TIMEOUT: return "deadline exceeded";
+    case ERR_BUSY: return "a call is outstanding on this handle";
+    case ERR_CANCELLED: return "call cancelled";
     default: return transport_strerror( n );
   }
 }
@@ -184,13 +228,43 @@ static void swap_bytes( uint8_t *number, size_t numbersize )
   }
 }
 
+// reverse the bytes of each of n elements of the given width, in place.
+// 4 and 8 byte elements are done 16 bytes at a time with a byte shuffle
+// where the target has one.
+static void swap_block( uint8_t *b, size_t n, size_t width )
+{
+  size_t i = 0, len = n * width;
+
+#if defined( __SSSE3__ )
+  if( width == 8 || width == 4 )
+  {
+    const __m128i mask = width == 8 ?
+      _mm_set_epi8( 8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7 ) :
+      _mm_set_epi8( 12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3 );
+    for( ; i + 16 <= len; i += 16 )
+      _mm_storeu_si128( ( __m128i * )( b + i ),
+        _mm_shuffle_epi8( _mm_loadu_si128( ( const __m128i * )( b + i ) ), mask ) );
+  }
+#elif defined( __ARM_NEON )
+  if( width == 8 )
+    for( ; i + 16 <= len; i += 16 )
+      vst1q_u8( b + i, vrev64q_u8( vld1q_u8( b + i ) ) );
+  else if( width == 4 )
+    for( ; i + 16 <= len; i += 16 )
+      vst1q_u8( b + i, vrev32q_u8( vld1q_u8( b + i ) ) );
+#endif
+
+  for( ; i < len; i += width )
+    swap_bytes( b + i, width );
+}
+
 union u32_bytes {
   uint32_t i;
   uint8_t  b[ 4 ];
 };
 
 // read a u32 from the transport
-static u32 transport_read_u32( Transport *tpt )
+static u32 generic_read_u32( Transport *tpt )
 {
   union u32_bytes ub;
   struct exception e;
@@ -203,7 +277,7 @@ static u32 transport_read_u32( Transport *tpt )
 
 
 // write a u32 to the transport
-static void transport_write_u32( Transport *tpt, u32 x )
+static void generic_write_u32( Transport *tpt, u32 x )
 {
   union u32_bytes ub;
   struct exception e;
@@ -215,7 +289,7 @@ static void transport_write_u32( Transport *tpt, u32 x )
 }
 
 // read a lua number from the transport
-static lua_Number transport_read_number( Transport *tpt )
+static lua_Number generic_read_number( Transport *tpt )
 {
   lua_Number x;
   u8 b[ tpt->lnum_bytes ];
@@ -257,7 +331,7 @@ static lua_Number transport_read_number( Transport *tpt )
 
 
 // write a lua number to the transport
-static void transport_write_number( Transport *tpt, lua_Number x )
+static void generic_write_number( Transport *tpt, lua_Number x )
 {
   struct exception e;
   TRANSPORT_VERIFY_OPEN;
@@ -301,6 +375,195 @@ static void transport_write_number( Transport *tpt, lua_Number x )
 
 
 
+// codecs
+//   the byte order and number format of a connection are fixed once it has
+//   been negotiated, so instead of checking them for every field, negotiation
+//   picks one of these function tables. the native codec copies values as
+//   they are and the swapped codec only reverses their bytes. both are
+//   generated from DEFINE_CODEC. the generic codec above handles peers that
+//   use a different number size or format.
+
+typedef struct _Codec Codec;
+struct _Codec {
+  u32 ( *read_u32 )( Transport *tpt );
+  void ( *write_u32 )( Transport *tpt, u32 x );
+  lua_Number ( *read_number )( Transport *tpt );
+  void ( *write_number )( Transport *tpt, lua_Number x );
+  void ( *read_numbers )( Transport *tpt, lua_Number *x, u32 n );
+  void ( *write_numbers )( Transport *tpt, const lua_Number *x, u32 n );
+};
+
+union number_bytes {
+  lua_Number n;
+  uint8_t    b[ sizeof( lua_Number ) ];
+};
+
+#define NO_SWAP( b, n ) ( ( void )0 )
+#define SWAP( b, n ) swap_bytes( b, n )
+#define NO_SWAP_BLOCK( b, n, width ) ( ( void )0 )
+#define SWAP_BLOCK( b, n, width ) swap_block( b, n, width )
+
+#define DEFINE_CODEC( name, swap, swapn ) \
+static u32 name##_read_u32( Transport *tpt ) \
+{ \
+  union u32_bytes ub; \
+  transport_read_buffer( tpt, ub.b, 4 ); \
+  swap( ub.b, 4 ); \
+  return ub.i; \
+} \
+static void name##_write_u32( Transport *tpt, u32 x ) \
+{ \
+  union u32_bytes ub; \
+  ub.i = ( uint32_t )x; \
+  swap( ub.b, 4 ); \
+  transport_write_buffer( tpt, ub.b, 4 ); \
+} \
+static lua_Number name##_read_number( Transport *tpt ) \
+{ \
+  union number_bytes nb; \
+  transport_read_buffer( tpt, nb.b, sizeof( lua_Number ) ); \
+  swap( nb.b, sizeof( lua_Number ) ); \
+  return nb.n; \
+} \
+static void name##_write_number( Transport *tpt, lua_Number x ) \
+{ \
+  union number_bytes nb; \
+  nb.n = x; \
+  swap( nb.b, sizeof( lua_Number ) ); \
+  transport_write_buffer( tpt, nb.b, sizeof( lua_Number ) ); \
+} \
+static void name##_read_numbers( Transport *tpt, lua_Number *x, u32 n ) \
+{ \
+  transport_read_buffer( tpt, ( u8 * )x, n * sizeof( lua_Number ) ); \
+  swapn( ( uint8_t * )x, n, sizeof( lua_Number ) ); \
+} \
+static void name##_write_numbers( Transport *tpt, const lua_Number *x, u32 n ) \
+{ \
+  lua_Number block[ NUMARRAY_BLOCK ]; \
+  u32 i, len; \
+  for( i = 0; i < n; i += len ) \
+  { \
+    len = n - i < NUMARRAY_BLOCK ? n - i : NUMARRAY_BLOCK; \
+    memcpy( block, x + i, len * sizeof( lua_Number ) ); \
+    swapn( ( uint8_t * )block, len, sizeof( lua_Number ) ); \
+    transport_write_buffer( tpt, ( u8 * )block, len * sizeof( lua_Number ) ); \
+  } \
+} \
+static const Codec name##_codec = \
+{ \
+  name##_read_u32, name##_write_u32, name##_read_number, name##_write_number, \
+  name##_read_numbers, name##_write_numbers \
+};
+
+DEFINE_CODEC( native, NO_SWAP, NO_SWAP_BLOCK )
+DEFINE_CODEC( swapped, SWAP, SWAP_BLOCK )
+
+static void generic_read_numbers( Transport *tpt, lua_Number *x, u32 n )
+{
+  u32 i;
+  for( i = 0; i < n; i ++ )
+    x[ i ] = generic_read_number( tpt );
+}
+
+static void generic_write_numbers( Transport *tpt, const lua_Number *x, u32 n )
+{
+  u32 i;
+  for( i = 0; i < n; i ++ )
+    generic_write_number( tpt, x[ i ] );
+}
+
+static const Codec generic_codec =
+{
+  generic_read_u32, generic_write_u32, generic_read_number, generic_write_number,
+  generic_read_numbers, generic_write_numbers
+};
+
+// pick the cheapest codec for the negotiated configuration
+static void codec_select( Transport *tpt )
+{
+  if( tpt->lnum_bytes != sizeof( lua_Number ) || tpt->net_intnum != tpt->loc_intnum )
+    tpt->codec = &generic_codec;
+  else if( tpt->net_little == tpt->loc_little )
+    tpt->codec = &native_codec;
+  else
+    tpt->codec = &swapped_codec;
+}
+
+static u32 transport_read_u32( Transport *tpt )
+{
+  return tpt->codec->read_u32( tpt );
+}
+
+static void transport_write_u32( Transport *tpt, u32 x )
+{
+  tpt->codec->write_u32( tpt, x );
+}
+
+static lua_Number transport_read_number( Transport *tpt )
+{
+  return tpt->codec->read_number( tpt );
+}
+
+static void transport_write_number( Transport *tpt, lua_Number x )
+{
+  tpt->codec->write_number( tpt, x );
+}
+
+static void transport_read_numbers( Transport *tpt, lua_Number *x, u32 n )
+{
+  tpt->codec->read_numbers( tpt, x, n );
+}
+
+static void transport_write_numbers( Transport *tpt, const lua_Number *x, u32 n )
+{
+  tpt->codec->write_numbers( tpt, x, n );
+}
+
+
+// memory buffers
+//   rpc.encode and rpc.decode point a transport at one of these instead of a
+//   connection. the transport read and write functions hand the bytes to
+//   these when tpt->mem is set.
+
+void membuf_read( MemBuf *mb, u8 *buffer, int length )
+{
+  struct exception e;
+
+  if( length > mb->len - mb->pos )
+  {
+    e.errnum = ERR_EOF;
+    e.type = nonfatal;
+    Throw( e );
+  }
+  memcpy( buffer, mb->data + mb->pos, length );
+  mb->pos += length;
+}
+
+void membuf_write( MemBuf *mb, const u8 *buffer, int length )
+{
+  struct exception e;
+
+  if( length > mb->size - mb->len )
+  {
+    size_t size = mb->size ? mb->size * 2 : 256;
+    u8 *data;
+    while( size < mb->len + length )
+      size *= 2;
+    data = ( u8 * )realloc( mb->data, size );
+    if( data == NULL )
+    {
+      e.errnum = ENOMEM;
+      e.type = fatal;
+      Throw( e );
+    }
+    mb->data = data;
+    mb->size = size;
+  }
+  memcpy( mb->data + mb->len, buffer, length );
+  mb->len += length;
+}
+
+
 // **************************************************************************
 // lua utilities
 
@@ -362,6 +625,53 @@ static void write_table( Transport *tpt, lua_State *L, int table_index )
   }
 }
 
+// return the length of the table at the given index if it is a sequence
+// 1..n of numbers with nothing else in it, or 0 if it is not (or is too
+// short to be worth packing).
+static u32 numarray_length( lua_State *L, int table_index )
+{
+  size_t n = lua_objlen( L, table_index ), count = 0;
+  lua_Number k;
+
+  if( n < NUMARRAY_MIN || n > 0xFFFFFFFFUL )
+    return 0;
+  lua_pushnil( L );
+  while( lua_next( L, table_index ) )
+  {
+    if( lua_type( L, -1 ) != LUA_TNUMBER || lua_type( L, -2 ) != LUA_TNUMBER ||
+        ( k = lua_tonumber( L, -2 ) ) < 1 || k > n || k != ( lua_Number )( size_t )k ||
+        ++ count > n )
+    {
+      lua_pop( L, 2 );
+      return 0;
+    }
+    lua_pop( L, 1 );
+  }
+  return count == n ? ( u32 )n : 0;
+}
+
+// write the numbers of a table that numarray_length accepted as one
+// contiguous block, converting them NUMARRAY_BLOCK at a time.
+static void write_numarray( Transport *tpt, lua_State *L, int table_index, u32 n )
+{
+  lua_Number block[ NUMARRAY_BLOCK ];
+  u32 i, j, len;
+
+  transport_write_u32( tpt, n );
+  transport_write_u8( tpt, tpt->lnum_bytes );
+  for( i = 0; i < n; i += len )
+  {
+    len = n - i < NUMARRAY_BLOCK ? n - i : NUMARRAY_BLOCK;
+    for( j = 0; j < len; j ++ )
+    {
+      lua_rawgeti( L, table_index, i + j + 1 );
+      block[ j ] = lua_tonumber( L, -1 );
+      lua_pop( L, 1 );
+    }
+    transport_write_numbers( tpt, block, len );
+  }
+}
+
 static int writer( lua_State *L, const void* b, size_t size, void* B ) {
   (void)L;
   luaL_addlstring((luaL_Buffer*) B, (const char *)b, size);
@@ -422,7 +732,7 @@ static void write_function( Transport *tpt, lua_State *L, int var_index )
 }
 #endif
 
-static void helper_remote_index( Helper *helper );
+static void helper_remote_index( Transport *tpt, Helper *helper );
 
 // write a variable at the given index in the stack. the index must be absolute
 // (i.e. positive).
@@ -451,10 +761,19 @@ static void write_variable( Transport *tpt, lua_State *L, int var_index )
     }
 
     case LUA_TTABLE:
+    {
+      u32 n = numarray_length( L, var_index );
+      if( n )
+      {
+        transport_write_u8( tpt, RPC_NUMARRAY );
+        write_numarray( tpt, L, var_index, n );
+        break;
+      }
       transport_write_u8( tpt, RPC_TABLE );
       write_table( tpt, L, var_index );
       transport_write_u8( tpt, RPC_TABLE_END );
       break;
+    }
 
     case LUA_TNIL:
       transport_write_u8( tpt, RPC_NIL );
@@ -475,8 +794,18 @@ static void write_variable( Transport *tpt, lua_State *L, int var_index )
       if( lua_isuserdata( L, var_index ) && ismetatable_type( L, var_index, "rpc.helper" ) )
       {
         transport_write_u8( tpt, RPC_REMOTE );
-        helper_remote_index( ( Helper * )lua_touserdata( L, var_index ) );
-      } else
+        helper_remote_index( tpt, ( Helper * )lua_touserdata( L, var_index ) );
+      }
+      else if( lua_isuserdata( L, var_index ) && ismetatable_type( L, var_index, "rpc.blob" ) )
+      {
+        Blob *b = ( Blob * )lua_touserdata( L, var_index );
+        if( b->file == NULL )
+          luaL_error( L, "attempt to send a closed blob" );
+        transport_write_u8( tpt, RPC_BLOB );
+        transport_write_u32( tpt, b->length );
+        transport_write_file( tpt, b->file, b->offset, b->length );
+      }
+      else
         luaL_error( L, "userdata transmission unsupported" );
       break;
 
@@ -507,6 +836,35 @@ static void read_table( Transport *tpt, lua_State *L )
   }
 }
 
+// read a packed array of numbers into a table sized for it up front
+static void read_numarray( Transport *tpt, lua_State *L )
+{
+  lua_Number block[ NUMARRAY_BLOCK ];
+  struct exception e;
+  u32 n, i, j, len;
+  int table_index;
+
+  n = transport_read_u32( tpt );
+  if( transport_read_u8( tpt ) != tpt->lnum_bytes )
+  {
+    e.errnum = ERR_PROTOCOL;
+    e.type = fatal;
+    Throw( e );
+  }
+  lua_createtable( L, n > INT_MAX ? INT_MAX : ( int )n, 0 );
+  table_index = lua_gettop( L );
+  for( i = 0; i < n; i += len )
+  {
+    len = n - i < NUMARRAY_BLOCK ? n - i : NUMARRAY_BLOCK;
+    transport_read_numbers( tpt, block, len );
+    for( j = 0; j < len; j ++ )
+    {
+      lua_pushnumber( L, block[ j ] );
+      lua_rawseti( L, table_index, i + j + 1 );
+    }
+  }
+}
+
 // read function and load
 static void read_function( Transport *tpt, lua_State *L )
 {
@@ -548,6 +906,78 @@ static void read_index( Transport *tpt, lua_State *L )
 }
 
 
+// read a string of the given length and push it. this goes through a
+// luaL_Buffer so that large strings are never staged on the C stack.
+static void read_string( Transport *tpt, lua_State *L, u32 len )
+{
+  luaL_Buffer b;
+
+  luaL_buffinit( L, &b );
+  while( len > 0 )
+  {
+    u32 n = len < LUAL_BUFFERSIZE ? len : LUAL_BUFFERSIZE;
+    transport_read_string( tpt, luaL_prepbuffer( &b ), n );
+    luaL_addsize( &b, n );
+    len -= n;
+  }
+  luaL_pushresult( &b );
+}
+
+
+static Blob *blob_create( lua_State *L, const char *path, FILE *f, u32 offset, u32 length );
+
+// read a blob. without a blob sink on the transport this is read just like
+// a string. with one, the bytes are written to a new file in the sink
+// directory and a blob referring to that file is pushed instead.
+static void read_blob( Transport *tpt, lua_State *L )
+{
+  struct exception e;
+  u32 len = transport_read_u32( tpt );
+  char *path;
+  FILE *f;
+
+  if( tpt->blob_sink == LUA_NOREF )
+  {
+    read_string( tpt, L, len );
+    return;
+  }
+
+  lua_rawgeti( L, LUA_REGISTRYINDEX, tpt->blob_sink );
+  path = ( char * )alloca( lua_strlen( L, -1 ) + sizeof( "/blob-XXXXXX" ) );
+  strcpy( path, lua_tostring( L, -1 ) );
+  strcat( path, "/blob-XXXXXX" );
+  lua_pop( L, 1 );
+
+#ifdef WIN32_BUILD
+  f = _mktemp( path ) ? fopen( path, "w+b" ) : NULL;
+#else
+  {
+    int fd = mkstemp( path );
+    f = fd < 0 ? NULL : fdopen( fd, "w+b" );
+  }
+#endif
+  if( f == NULL )
+  {
+    e.errnum = transport_errno;
+    e.type = fatal;
+    Throw( e );
+  }
+
+  Try
+  {
+    transport_read_file( tpt, f, len );
+  }
+  Catch( e )
+  {
+    fclose( f );
+    remove( path );
+    Throw( e );
+  }
+  fflush( f );
+  blob_create( L, path, f, 0, len );
+}
+
+
 // read a variable and push in onto the stack. this returns 1 if a "normal"
 // variable was read, or 0 if an end-table or end-function marker was read (in which case
 // nothing is pushed onto the stack).
@@ -571,14 +1001,8 @@ static int read_variable( Transport *tpt, lua_State *L )
       break;
 
     case RPC_STRING:
-    {
-      u32 len = transport_read_u32( tpt );
-      char *s = ( char * )alloca( len + 1 );
-      transport_read_string( tpt, s, len );
-      s[ len ] = 0;
-      lua_pushlstring( L, s, len );
+      read_string( tpt, L, transport_read_u32( tpt ) );
       break;
-    }
 
     case RPC_TABLE:
       read_table( tpt, L );
@@ -598,6 +1022,14 @@ static int read_variable( Transport *tpt, lua_State *L )
       read_index( tpt, L );
       break;
 
+    case RPC_BLOB:
+      read_blob( tpt, L );
+      break;
+
+    case RPC_NUMARRAY:
+      read_numarray( tpt, L );
+      break;
+
     default:
       e.errnum = type;
       e.type = fatal;
@@ -612,16 +1044,9 @@ static int read_variable( Transport *tpt, lua_State *L )
 
 // functions for sending and receving headers
 
-static void client_negotiate( Transport *tpt )
+static void client_write_header( Transport *tpt )
 {
-  struct exception e;
   char header[ 8 ];
-  int x = 1;
-
-  // default client configuration
-  tpt->loc_little = ( char )*( char * )&x;
-  tpt->lnum_bytes = ( char )sizeof( lua_Number );
-  tpt->loc_intnum = ( char )( ( ( lua_Number )0.5 ) == 0 );
 
   // write the protocol header
   header[0] = 'L';
@@ -633,9 +1058,15 @@ static void client_negotiate( Transport *tpt )
   header[6] = tpt->lnum_bytes;
   header[7] = tpt->loc_intnum;
   transport_write_string( tpt, header, sizeof( header ) );
+}
 
+static void client_read_header( Transport *tpt )
+{
+  struct exception e;
+  char header[ 8 ];
 
   // read server's response
+  tpt->header_pending = 0;
   transport_read_string( tpt, header, sizeof( header ) );
   if( header[0] != 'L' ||
       header[1] != 'R' ||
@@ -643,6 +1074,7 @@ static void client_negotiate( Transport *tpt )
       header[3] != 'C' ||
       header[4] != RPC_PROTOCOL_VERSION )
   {
+    RPC_PROBE2( negotiate__fail, 0, ERR_HEADER );
     e.errnum = ERR_HEADER;
     e.type = nonfatal;
     Throw( e );
@@ -652,6 +1084,21 @@ static void client_negotiate( Transport *tpt )
   tpt->net_little = header[5];
   tpt->lnum_bytes = header[6];
   tpt->net_intnum = header[7];
+  codec_select( tpt );
+  RPC_PROBE4( negotiate, 0, tpt->lnum_bytes, tpt->net_little, tpt->net_intnum );
+}
+
+static void client_negotiate( Transport *tpt )
+{
+  int x = 1;
+
+  // default client configuration
+  tpt->loc_little = ( char )*( char * )&x;
+  tpt->lnum_bytes = ( char )sizeof( lua_Number );
+  tpt->loc_intnum = ( char )( ( ( lua_Number )0.5 ) == 0 );
+
+  client_write_header( tpt );
+  client_read_header( tpt );
 }
 
 static void server_negotiate( Transport *tpt )
@@ -673,6 +1120,7 @@ static void server_negotiate( Transport *tpt )
       header[3] != 'C' ||
       header[4] != RPC_PROTOCOL_VERSION )
   {
+    RPC_PROBE2( negotiate__fail, 1, ERR_HEADER );
     e.errnum = ERR_HEADER;
     e.type = nonfatal;
     Throw( e );
@@ -694,11 +1142,35 @@ static void server_negotiate( Transport *tpt )
 
   // send reconciled configuration to client
   transport_write_string( tpt, header, sizeof( header ) );
+  codec_select( tpt );
+  RPC_PROBE4( negotiate, 1, tpt->lnum_bytes, tpt->net_little, tpt->net_intnum );
 }
 
 
+// count an error against a transport
+static void stats_error( Transport *tpt, int errnum )
+{
+  switch( errnum )
+  {
+    case ERR_EOF: tpt->stats.errors[ STAT_ERR_EOF ]++; break;
+    case ERR_CLOSED: tpt->stats.errors[ STAT_ERR_CLOSED ]++; break;
+    case ERR_PROTOCOL: tpt->stats.errors[ STAT_ERR_PROTOCOL ]++; break;
+    case ERR_NODATA: tpt->stats.errors[ STAT_ERR_NODATA ]++; break;
+    case ERR_COMMAND:
+    case ERR_BUSY: tpt->stats.errors[ STAT_ERR_COMMAND ]++; break;
+    case ERR_HEADER: tpt->stats.errors[ STAT_ERR_HEADER ]++; break;
+    case ERR_TIMEOUT: tpt->stats.errors[ STAT_ERR_TIMEOUT ]++; break;
+    default: tpt->stats.errors[ STAT_ERR_SYSTEM ]++;
+  }
+}
+
 static int generic_catch_handler(lua_State *L, Handle *handle, struct exception e )
 {
+  stats_error( &handle->tpt, e.errnum );
+  // close before reporting, which may not return. a connection the server
+  // has closed is no more use, and a reconnecting handle reopens it.
+  if( e.type == fatal || e.errnum == ERR_EOF )
+    transport_close( &handle->tpt );
   deal_with_error( L, handle, errorString( e.errnum ) );
   switch( e.type )
   {
@@ -707,7 +1179,6 @@ static int generic_catch_handler(lua_State *L, Handle *handle, struct exception
       return 1;
       break;
     case fatal:
-      transport_close( &handle->tpt );
       break;
     default: lua_assert( 0 );
   }
@@ -750,12 +1221,66 @@ Handle *handle_create( lua_State *L )
   h->error_handler = LUA_NOREF;
   h->async = 0;
   h->read_reply_count = 0;
+  h->cache_ref = LUA_NOREF;
+  h->cache_validate = 0;
+  h->cache_ttl = 0;
+  h->deadline_ms = 0;
+  h->call_id = 0;
+  transport_init( &h->tpt );
+  h->tpt.pending = 0;
+  h->tpt.outstanding = 0;
+  h->tpt.heartbeat = 0;
+  h->tpt.heartbeat_timeout = HEARTBEAT_TIMEOUT;
+  h->tpt.last_active = rpc_clock();
+  h->tpt.header_pending = 0;
+  h->connect_ref = LUA_NOREF;
+  h->reconnect = 0;
+  h->reconnect_delay = RECONNECT_MIN_DELAY;
+  h->reconnect_max = RECONNECT_MAX_DELAY;
+  h->reconnect_at = 0;
+  h->timeout_ms = 0;
+  h->keepalive[ 0 ] = 0;
+  h->endpoint = 0;
+  h->subs_ref = LUA_NOREF;
+  h->events_ref = LUA_NOREF;
+  h->watches_ref = LUA_NOREF;
+  h->tpt.codec = &generic_codec;
+  memset( &h->tpt.stats, 0, sizeof( Stats ) );
+  return h;
+}
+
+static int handle_close( lua_State *L )
+{
+  Handle *h = ( Handle * )luaL_checkudata( L, 1, "rpc.handle" );
+
+  luaL_unref( L, LUA_REGISTRYINDEX, h->cache_ref );
+  luaL_unref( L, LUA_REGISTRYINDEX, h->tpt.blob_sink );
+  luaL_unref( L, LUA_REGISTRYINDEX, h->connect_ref );
+  luaL_unref( L, LUA_REGISTRYINDEX, h->subs_ref );
+  luaL_unref( L, LUA_REGISTRYINDEX, h->events_ref );
+  luaL_unref( L, LUA_REGISTRYINDEX, h->watches_ref );
+  h->cache_ref = LUA_NOREF;
+  h->tpt.blob_sink = LUA_NOREF;
+  h->connect_ref = LUA_NOREF;
+  h->subs_ref = LUA_NOREF;
+  h->events_ref = LUA_NOREF;
+  h->watches_ref = LUA_NOREF;
+  return 0;
+}
+
+// helpers carry their name inline, so the userdata is only as large as the
+// name requires and there is no limit on name length
+static Helper *helper_alloc( lua_State *L, const char *funcname )
+{
+  size_t len = strlen( funcname );
+  Helper *h = ( Helper * )lua_newuserdata( L, offsetof( Helper, funcname ) + len + 1 );
+  memcpy( h->funcname, funcname, len + 1 );
   return h;
 }
 
 static Helper *helper_create( lua_State *L, Handle *handle, const char *funcname )
 {
-  Helper *h = ( Helper * )lua_newuserdata( L, sizeof( Helper ) );
+  Helper *h = helper_alloc( L, funcname );
   luaL_getmetatable( L, "rpc.helper" );
   lua_setmetatable( L, -2 );
 
@@ -764,11 +1289,81 @@ static Helper *helper_create( lua_State *L, Handle *handle, const char *funcname
   h->handle = handle;
   h->parent = NULL;
   h->nparents = 0;
-  strncpy( h->funcname, funcname, NUM_FUNCNAME_CHARS );
+  h->deadline_ms = 0;
+  h->hedged = 0;
+  h->pool = NULL;
   return h;
 }
 
 
+// helper memoization
+//   indexing the same handle or helper with the same key returns the same
+//   helper object rather than allocating a new userdata (and registry
+//   reference) every time. the cache is a registry table mapping each parent
+//   weakly to a table of its children, which are themselves held weakly so
+//   that unused helpers are still collected.
+
+static void helper_cache_init( lua_State *L )
+{
+  // metatable shared by all per-parent child tables
+  lua_newtable( L );
+  lua_pushliteral( L, "v" );
+  lua_setfield( L, -2, "__mode" );
+  lua_setfield( L, LUA_REGISTRYINDEX, "rpc.helper_children" );
+
+  lua_newtable( L );
+  lua_newtable( L );
+  lua_pushliteral( L, "k" );
+  lua_setfield( L, -2, "__mode" );
+  lua_setmetatable( L, -2 );
+  lua_setfield( L, LUA_REGISTRYINDEX, "rpc.helper_cache" );
+}
+
+// push the child table of the parent at stack index 1, creating it if needed
+static void helper_cache_children( lua_State *L )
+{
+  lua_getfield( L, LUA_REGISTRYINDEX, "rpc.helper_cache" );
+  lua_pushvalue( L, 1 );
+  lua_rawget( L, -2 );
+  if( lua_isnil( L, -1 ) )
+  {
+    lua_pop( L, 1 );
+    lua_newtable( L );
+    lua_getfield( L, LUA_REGISTRYINDEX, "rpc.helper_children" );
+    lua_setmetatable( L, -2 );
+    lua_pushvalue( L, 1 );
+    lua_pushvalue( L, -2 );
+    lua_rawset( L, -4 );
+  }
+  lua_remove( L, -2 );
+}
+
+// push the cached child of the parent at index 1 named by the string at
+// index 2. returns 0 and leaves the child table on the stack if there is none.
+static int helper_cache_lookup( lua_State *L )
+{
+  helper_cache_children( L );
+  lua_pushvalue( L, 2 );
+  lua_rawget( L, -2 );
+  if( lua_isnil( L, -1 ) )
+  {
+    lua_pop( L, 1 );
+    return 0;
+  }
+  lua_remove( L, -2 );
+  return 1;
+}
+
+// store the helper on top of the stack in the child table just below it,
+// leaving only the helper on the stack
+static void helper_cache_store( lua_State *L )
+{
+  lua_pushvalue( L, 2 );
+  lua_pushvalue( L, -2 );
+  lua_rawset( L, -4 );
+  lua_remove( L, -2 );
+}
+
 // indexing a handle returns a helper
 static int handle_index (lua_State *L)
 {
@@ -780,10 +1375,12 @@ static int handle_index (lua_State *L)
   if( lua_type( L, 2 ) != LUA_TSTRING )
     return luaL_error( L, "can't index a handle with a non-string" );
   s = lua_tostring( L, 2 );
-  if ( strlen( s ) > NUM_FUNCNAME_CHARS - 1 )
-    return luaL_error( L, errorString( ERR_LONGFNAME ) );
+
+  if( helper_cache_lookup( L ) )
+    return 1;
 
   helper_create( L, ( Handle * )lua_touserdata( L, 1 ), s );
+  helper_cache_store( L );
 
   // return the helper object
   return 1;
@@ -794,16 +1391,11 @@ static int helper_newindex( lua_State *L );
 // indexing a handle returns a helper
 static int handle_newindex( lua_State *L )
 {
-  const char *s;
-
   check_num_args( L, 3 );
   MYASSERT( lua_isuserdata( L, 1 ) && ismetatable_type( L, 1, "rpc.handle" ) );
 
   if( lua_type( L, 2 ) != LUA_TSTRING )
     return luaL_error( L, "can't index handle with a non-string" );
-  s = lua_tostring( L, 2 );
-  if ( strlen( s ) > NUM_FUNCNAME_CHARS - 1 )
-    return luaL_error( L, errorString( ERR_LONGFNAME ) );
 
   helper_create( L, ( Handle * )lua_touserdata( L, 1 ), "" );
   lua_replace(L, 1);
@@ -814,11 +1406,10 @@ static int handle_newindex( lua_State *L )
 }
 
 // replays series of indexes to remote side as a string
-static void helper_remote_index( Helper *helper )
+static void helper_remote_index( Transport *tpt, Helper *helper )
 {
   int i, len;
   Helper **hstack;
-  Transport *tpt = &helper->handle->tpt;
 
   // get length of name & make stack of helpers
   len = strlen( helper->funcname );
@@ -849,761 +1440,4461 @@ static void helper_remote_index( Helper *helper )
   transport_write_string( tpt, helper->funcname, strlen( helper->funcname ) );
 }
 
-static void helper_wait_ready( Transport *tpt, u8 cmd )
+// push the dotted remote path of a helper, e.g. "a.b.c"
+static void helper_push_path( lua_State *L, Helper *helper )
 {
-  struct exception e;
-  u8 cmdresp;
+  int i;
+  Helper **hstack;
+  luaL_Buffer b;
 
-  transport_write_u8( tpt, cmd );
-  cmdresp = transport_read_u8( tpt );
-  if( cmdresp != RPC_READY )
+  hstack = ( Helper ** )alloca( sizeof( Helper * ) * ( helper->nparents + 1 ) );
+  hstack[ helper->nparents ] = helper;
+  for( i = helper->nparents; i > 0; i -- )
+    hstack[ i - 1 ] = hstack[ i ]->parent;
+
+  luaL_buffinit( L, &b );
+  for( i = 0; i <= helper->nparents; i ++ )
   {
-    e.errnum = ERR_PROTOCOL;
-    e.type = nonfatal;
-    Throw( e );
+    if( i > 0 )
+      luaL_addchar( &b, '.' );
+    luaL_addstring( &b, hstack[ i ]->funcname );
   }
-
+  luaL_pushresult( &b );
 }
 
-static int helper_get( lua_State *L, Helper *helper )
+// read and throw away the replies to calls whose deadline passed before
+// they arrived, so the next reply read is the one to our own command
+static void helper_drain( lua_State *L, Transport *tpt )
 {
-  struct exception e;
-  int freturn = 0;
-  Transport *tpt = &helper->handle->tpt;
+  int top = lua_gettop( L );
+  u32 i, n;
 
-  Try
+  while( tpt->pending > 0 )
   {
-    helper_wait_ready( tpt, RPC_CMD_GET );
-    helper_remote_index( helper );
+    transport_read_u32( tpt ); // call id
+    if( transport_read_u8( tpt ) == 0 )
+    {
+      n = transport_read_u32( tpt );
+      for( i = 0; i < n; i ++ )
+        read_variable( tpt, L );
+    }
+    else
+    {
+      transport_read_u32( tpt ); // error code
+      read_string( tpt, L, transport_read_u32( tpt ) );
+    }
+    lua_settop( L, top );
+    tpt->pending--;
+  }
+}
 
-    read_variable( tpt, L );
+// nonzero if one dotted path is the other or one of its prefixes, so a
+// change to either changes the other
+static int path_related( const char *a, size_t alen, const char *b, size_t blen )
+{
+  if( alen > blen )
+    return path_related( b, blen, a, alen );
+  return memcmp( a, b, alen ) == 0 && ( alen == blen || b[ alen ] == '.' );
+}
 
-    freturn = 1;
+// drop get() cache entries a change to path makes stale
+static void cache_forget( lua_State *L, Handle *handle, const char *path, size_t len )
+{
+  if( handle->cache_ref == LUA_NOREF )
+    return;
+  lua_rawgeti( L, LUA_REGISTRYINDEX, handle->cache_ref );
+  for( lua_pushnil( L ); lua_next( L, -2 ); lua_pop( L, 1 ) )
+    if( path_related( path, len, lua_tostring( L, -2 ), lua_strlen( L, -2 ) ) )
+    {
+      lua_pushvalue( L, -2 );
+      lua_pushnil( L );
+      lua_rawset( L, -5 ); // clearing a field doesn't upset lua_next
+    }
+  lua_pop( L, 1 );
+}
+
+// read an event the server pushed after the RPC_PUSH or RPC_NOTIFY marker,
+// queueing it for rpc.step as { topic or path, value, is_watch }. pushes
+// only come where the client waits for RPC_READY or has no command in
+// progress, so they never split a reply.
+static void client_read_push( lua_State *L, Handle *handle, u8 marker )
+{
+  Transport *tpt = &handle->tpt;
+
+  if( handle->events_ref == LUA_NOREF )
+  {
+    lua_newtable( L );
+    handle->events_ref = luaL_ref( L, LUA_REGISTRYINDEX );
   }
-  Catch( e )
+  lua_rawgeti( L, LUA_REGISTRYINDEX, handle->events_ref );
+  lua_createtable( L, 3, 0 );
+  read_string( tpt, L, transport_read_u32( tpt ) ); // topic or path
+  if( marker == RPC_NOTIFY )
   {
-    freturn = generic_catch_handler( L, helper->handle, e );
+    cache_forget( L, handle, lua_tostring( L, -1 ), lua_strlen( L, -1 ) );
+    lua_pushboolean( L, 1 );
+    lua_rawseti( L, -3, 3 );
   }
-  return freturn;
+  lua_rawseti( L, -2, 1 );
+  if( marker == RPC_PUSH || transport_read_u8( tpt ) )
+  {
+    read_variable( tpt, L );
+    lua_rawseti( L, -2, 2 );
+  }
+  lua_rawseti( L, -2, ( int )lua_objlen( L, -2 ) + 1 );
+  lua_pop( L, 1 );
+  tpt->stats.pushes++;
 }
 
+// read the status answering a command, queueing any events pushed first
+static u8 client_read_status( lua_State *L, Handle *handle )
+{
+  u8 status;
 
-// static int helper_async( lua_State *L )
-// {
-//     /* first read out any pending return values for old async calls */
-//     for (; h->handle->read_reply_count > 0; h->handle->read_reply_count--) {
-//       ret_code = transport_read_u8 (tpt);   /* return code */
-//       if( ret_code == 0 )
-//       {
-//         /* read return arguments, ignore everything we read */
-//         nret = transport_read_u32( tpt );
-//
-//         for (i=0; i < ( ( int ) nret ); i++)
-//           read_variable (tpt,L);
-//
-//         lua_pop (L,nret);
-//       }
-//       else
-//       {
-//         /* read error and handle it */
-//         u32 code = transport_read_u32( tpt );
-//         u32 len = transport_read_u32( tpt );
-//         char *err_string = ( char * )alloca( len + 1 );
-//         transport_read_string( tpt, err_string, len );
-//         err_string[ len ] = 0;
-//
-//         deal_with_error( L, h->handle, err_string );
-//         freturn = 0;
-//       }
-//     }
-// }
+  while( ( status = transport_read_u8( &handle->tpt ) ) == RPC_PUSH ||
+         status == RPC_NOTIFY )
+    client_read_push( L, handle, status );
+  return status;
+}
 
+// check the server is still there, closing the connection if it doesn't
+// answer within timeout seconds. returns the round trip time.
+static double helper_ping( lua_State *L, Handle *handle, double timeout )
+{
+  struct exception e;
+  Transport *tpt = &handle->tpt;
+  double start = rpc_clock();
 
+  tpt->stats.commands[ RPC_CMD_PING ]++;
+  transport_write_u8( tpt, RPC_CMD_PING );
+  if( !transport_wait_readable( tpt, timeout ) )
+  {
+    e.errnum = ERR_TIMEOUT;
+    e.type = fatal;
+    Throw( e );
+  }
+  if( tpt->header_pending )
+    client_read_header( tpt );
+  if( client_read_status( L, handle ) != RPC_READY )
+  {
+    e.errnum = ERR_PROTOCOL;
+    e.type = fatal;
+    Throw( e );
+  }
+  tpt->last_active = rpc_clock();
+  return tpt->last_active - start;
+}
 
+// reopen a handle's connection from inside lua_cpcall, which catches the
+// errors rpc.connect would raise. the header is sent with the number format
+// agreed last time and the server's answer is read along with the reply to
+// the next command, so reconnecting adds no round trip of its own.
+typedef struct
+{
+  Handle *handle;
+  int errnum;
+} Reopen;
 
-static int helper_call (lua_State *L)
+static int handle_reopen( lua_State *L )
 {
   struct exception e;
-  int freturn = 0;
-  Helper *h;
-  Transport *tpt;
-
-  h = ( Helper * )luaL_checkudata(L, 1, "rpc.helper");
-  luaL_argcheck(L, h, 1, "helper expected");
-
-  tpt = &h->handle->tpt;
+  Reopen *r = ( Reopen * )lua_touserdata( L, 1 );
+  Handle *handle = r->handle;
+  int i, n;
+
+  lua_settop( L, 0 );
+  lua_rawgeti( L, LUA_REGISTRYINDEX, handle->connect_ref );
+  n = ( int )lua_objlen( L, 1 );
+  for( i = 1; i <= n; i ++ )
+    lua_rawgeti( L, 1, i );
+  lua_remove( L, 1 );
+  lua_pushnil( L ); // where rpc.connect has the new handle
 
-  // capture special calls, otherwise execute normal remote call
-  if( strcmp("get", h->funcname ) == 0 )
+  Try
   {
-    helper_get( L, h->parent );
-    freturn = 1;
+    transport_open_connection( L, handle );
+    if( handle->timeout_ms )
+      transport_set_timeout( &handle->tpt, handle->timeout_ms );
+    if( handle->keepalive[ 0 ] )
+      transport_set_keepalive( &handle->tpt, handle->keepalive[ 0 ],
+                               handle->keepalive[ 1 ], handle->keepalive[ 2 ] );
+    transport_write_u8( &handle->tpt, RPC_CMD_CON );
+    client_write_header( &handle->tpt );
+    handle->tpt.header_pending = 1;
+  }
+  Catch( e )
+  {
+    r->errnum = e.errnum;
   }
+  return 0;
+}
+
+static void client_resubscribe( lua_State *L, Handle *handle );
+
+// reopen a closed connection if the handle reconnects, waiting twice as
+// long after each failure before trying again. calls made meanwhile fail
+// straight away rather than blocking in connect.
+static void handle_reconnect( lua_State *L, Handle *handle )
+{
+  struct exception e;
+  Transport *tpt = &handle->tpt;
+  jmp_buf *penv = the_exception_context->penv;
+  Reopen r;
+
+  r.handle = handle;
+  r.errnum = 0;
+  if( rpc_clock() < handle->reconnect_at )
+    r.errnum = ERR_CLOSED; // still backing off
   else
   {
-    Try
+    // a lua error out of handle_reopen skips its Try's cleanup and
+    // leaves the context pointing into a frame that's gone
+    if( lua_cpcall( L, handle_reopen, &r ) != 0 )
     {
-      int i,n;
-      u32 nret,ret_code;
+      the_exception_context->penv = penv;
+      lua_pop( L, 1 ); // error message
+      r.errnum = ERR_CLOSED;
+    }
+    else if( !transport_is_open( tpt ) )
+      r.errnum = ERR_CLOSED;
 
-      // write function name
-      helper_wait_ready( tpt, RPC_CMD_CALL );
-      helper_remote_index( h );
+    if( r.errnum )
+    {
+      transport_close( tpt );
+      handle->reconnect_at = rpc_clock() + handle->reconnect_delay;
+      handle->reconnect_delay *= 2;
+      if( handle->reconnect_delay > handle->reconnect_max )
+        handle->reconnect_delay = handle->reconnect_max;
+    }
+  }
+  if( r.errnum )
+  {
+    e.errnum = r.errnum;
+    e.type = nonfatal;
+    Throw( e );
+  }
 
-      // write number of arguments
-      n = lua_gettop( L );
-      transport_write_u32( tpt, n - 1 );
+  // replies owed on the old connection are gone with it
+  tpt->pending = 0;
+  tpt->outstanding = 0;
+  tpt->last_active = rpc_clock();
+  tpt->stats.connects++;
+  tpt->stats.reconnects++;
+  handle->reconnect_delay = RECONNECT_MIN_DELAY;
+  handle->reconnect_at = 0;
+
+  // the server's version stamps start over, so cached values can't be
+  // revalidated against them
+  if( handle->cache_ref != LUA_NOREF )
+  {
+    luaL_unref( L, LUA_REGISTRYINDEX, handle->cache_ref );
+    lua_newtable( L );
+    handle->cache_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  }
+  client_resubscribe( L, handle );
+}
 
-      // write each argument
-      for( i = 2; i <= n; i ++ )
-        write_variable( tpt, L, i );
+// get a handle ready to send a command: reconnect it if need be and skip
+// replies nobody is waiting for
+static void helper_prepare( lua_State *L, Handle *handle )
+{
+  struct exception e;
+  Transport *tpt = &handle->tpt;
 
-      /* if we're in async mode, we're done */
-      /*if ( h->handle->async )
-      {
-        h->handle->read_reply_count++;
-        freturn = 0;
-      }*/
+  if( handle->reconnect && !transport_is_open( tpt ) )
+    handle_reconnect( L, handle );
+  if( tpt->outstanding )
+  {
+    e.errnum = ERR_BUSY;
+    e.type = nonfatal;
+    Throw( e );
+  }
+  helper_drain( L, tpt );
+}
 
-      // read return code
-      ret_code = transport_read_u8( tpt );
+static void helper_wait_ready( lua_State *L, Handle *handle, u8 cmd )
+{
+  struct exception e;
+  Transport *tpt = &handle->tpt;
+  u8 cmdresp;
 
-      if ( ret_code == 0 )
-      {
-        // read return arguments
-        nret = transport_read_u32( tpt );
+  helper_prepare( L, handle );
+  if( tpt->heartbeat > 0 && rpc_clock() - tpt->last_active >= tpt->heartbeat )
+    helper_ping( L, handle, tpt->heartbeat_timeout );
+  tpt->stats.commands[ cmd ]++;
+  transport_write_u8( tpt, cmd );
+  if( tpt->header_pending )
+    client_read_header( tpt );
+  cmdresp = client_read_status( L, handle );
+  if( cmdresp != RPC_READY )
+  {
+    e.errnum = ERR_PROTOCOL;
+    e.type = nonfatal;
+    Throw( e );
+  }
+  tpt->last_active = rpc_clock();
 
-        for ( i = 0; i < ( ( int ) nret ); i ++ )
-          read_variable( tpt, L );
+}
 
-        freturn = ( int )nret;
-      }
-      else
-      {
-        // read error and handle it
-        transport_read_u32( tpt ); // read code (not being used here)
-        u32 len = transport_read_u32( tpt );
-        char *err_string = ( char * )alloca( len + 1 );
-        transport_read_string( tpt, err_string, len );
-        err_string[ len ] = 0;
-
-        deal_with_error( L, h->handle, err_string );
-        freturn = 0;
-      }
-    }
-    Catch( e )
+// ask the server to push a topic's events, or a path's changes, to us, or
+// to stop (op is SUB_* or WATCH_*)
+static void helper_subscribe( lua_State *L, Handle *handle, const char *topic, int op )
+{
+  Transport *tpt = &handle->tpt;
+  u32 len = ( u32 )strlen( topic );
+
+  helper_wait_ready( L, handle, RPC_CMD_SUBSCRIBE );
+  transport_write_u8( tpt, op );
+  transport_write_u32( tpt, len );
+  transport_write_string( tpt, topic, len );
+}
+
+// subscriptions and watches belong to a connection, so a reopened one
+// makes them again
+static void client_resubscribe( lua_State *L, Handle *handle )
+{
+  if( handle->subs_ref != LUA_NOREF )
+  {
+    lua_rawgeti( L, LUA_REGISTRYINDEX, handle->subs_ref );
+    for( lua_pushnil( L ); lua_next( L, -2 ); lua_pop( L, 1 ) )
+      helper_subscribe( L, handle, lua_tostring( L, -2 ), SUB_ON );
+    lua_pop( L, 1 );
+  }
+  if( handle->watches_ref != LUA_NOREF )
+  {
+    lua_rawgeti( L, LUA_REGISTRYINDEX, handle->watches_ref );
+    for( lua_pushnil( L ); lua_next( L, -2 ); lua_pop( L, 1 ) )
     {
-      freturn = generic_catch_handler( L, h->handle, e );
+      lua_rawgeti( L, -1, 2 );
+      helper_subscribe( L, handle, lua_tostring( L, -3 ), ( int )lua_tonumber( L, -1 ) );
+      lua_pop( L, 1 );
     }
+    lua_pop( L, 1 );
+  }
+}
+
+// handle.path:watch( callback [, "value" | "changed" ] )
+//    has the server tell us when path, a table inside it or a table holding
+//    it is assigned through the connection or with rpc.set. rpc.step then
+//    calls callback( value, path ), value being nil if only changes were
+//    asked for.
+static int helper_watch( lua_State *L, Helper *helper )
+{
+  static const char *const modes[] = { "value", "changed", NULL };
+  struct exception e;
+  int freturn = 0, op;
+  Handle *handle = helper->handle;
+
+  luaL_checktype( L, 3, LUA_TFUNCTION );
+  op = luaL_checkoption( L, 4, "value", modes ) ? WATCH_CHANGED : WATCH_VALUE;
+
+  if( handle->watches_ref == LUA_NOREF )
+  {
+    lua_newtable( L );
+    handle->watches_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  }
+  lua_rawgeti( L, LUA_REGISTRYINDEX, handle->watches_ref );
+  helper_push_path( L, helper );
+  lua_createtable( L, 2, 0 );
+  lua_pushvalue( L, 3 );
+  lua_rawseti( L, -2, 1 );
+  lua_pushnumber( L, op );
+  lua_rawseti( L, -2, 2 );
+  lua_pushvalue( L, -2 );
+  lua_insert( L, -2 );
+  lua_rawset( L, -4 ); // leaves the path on top
+
+  Try
+  {
+    helper_subscribe( L, handle, lua_tostring( L, -1 ), op );
+  }
+  Catch( e )
+  {
+    freturn = generic_catch_handler( L, handle, e );
   }
   return freturn;
 }
 
-// __newindex even on helper,
-static int helper_newindex( lua_State *L )
+// handle.path:unwatch()
+static int helper_unwatch( lua_State *L, Helper *helper )
 {
   struct exception e;
   int freturn = 0;
-  int ret_code;
-  Helper *h;
-  Transport *tpt;
+  Handle *handle = helper->handle;
 
-  h = ( Helper * )luaL_checkudata(L, -3, "rpc.helper");
-  luaL_argcheck(L, h, -3, "helper expected");
+  if( handle->watches_ref == LUA_NOREF )
+    return 0;
+  lua_rawgeti( L, LUA_REGISTRYINDEX, handle->watches_ref );
+  helper_push_path( L, helper );
+  lua_pushvalue( L, -1 );
+  lua_rawget( L, -3 );
+  if( lua_isnil( L, -1 ) )
+    return 0;
+  lua_pop( L, 1 );
+  lua_pushvalue( L, -1 );
+  lua_pushnil( L );
+  lua_rawset( L, -4 ); // leaves the path on top
 
-  luaL_checktype(L, -2, LUA_TSTRING );
+  Try
+  {
+    helper_subscribe( L, handle, lua_tostring( L, -1 ), WATCH_OFF );
+  }
+  Catch( e )
+  {
+    freturn = generic_catch_handler( L, handle, e );
+  }
+  return freturn;
+}
 
-  tpt = &h->handle->tpt;
+// get() cache entries are tables holding the value, the time at which it
+// goes stale, and the server's version stamp (0 unless revalidating)
+enum { CACHE_VALUE = 1, CACHE_EXPIRES, CACHE_VERSION };
 
-  Try
+static int helper_get( lua_State *L, Helper *helper )
+{
+  struct exception e;
+  int freturn = 0;
+  int ok = 0;
+  int cache = 0, path = 0, entry = 0;
+  u32 version = 0;
+  Handle *handle = helper->handle;
+  Transport *tpt = &handle->tpt;
+
+  // serve fresh results from the cache without a round trip
+  if( handle->cache_ref != LUA_NOREF )
   {
-    // index destination on remote side
-    helper_wait_ready( tpt, RPC_CMD_NEWINDEX );
-    helper_remote_index( h );
+    lua_rawgeti( L, LUA_REGISTRYINDEX, handle->cache_ref );
+    cache = lua_gettop( L );
+    helper_push_path( L, helper );
+    path = lua_gettop( L );
+    lua_pushvalue( L, path );
+    lua_rawget( L, cache );
+    if( lua_istable( L, -1 ) )
+    {
+      entry = lua_gettop( L );
+      lua_rawgeti( L, entry, CACHE_EXPIRES );
+      if( rpc_clock() < lua_tonumber( L, -1 ) )
+      {
+        lua_rawgeti( L, entry, CACHE_VALUE );
+        return 1;
+      }
+      lua_rawgeti( L, entry, CACHE_VERSION );
+      version = ( u32 )lua_tonumber( L, -1 );
+      lua_pop( L, 2 );
+    }
+  }
 
-    write_variable( tpt, L, lua_gettop( L ) - 1 );
-    write_variable( tpt, L, lua_gettop( L ) );
+  Try
+  {
+    if( cache && handle->cache_validate )
+    {
+      helper_wait_ready( L, handle, RPC_CMD_GETV );
+      helper_remote_index( tpt, helper );
+      transport_write_u32( tpt, version );
 
-    ret_code = transport_read_u8( tpt );
-    if( ret_code != 0 )
+      if( transport_read_u8( tpt ) )
+      {
+        version = transport_read_u32( tpt );
+        read_variable( tpt, L );
+      }
+      else if( entry ) // not modified, keep our copy
+        lua_rawgeti( L, entry, CACHE_VALUE );
+      else
+      {
+        e.errnum = ERR_PROTOCOL;
+        e.type = nonfatal;
+        Throw( e );
+      }
+    }
+    else
     {
-      // read error and handle it
-      transport_read_u32( tpt ); // Read code (not using here)
-      u32 len = transport_read_u32( tpt );
-      char *err_string = ( char * )alloca( len + 1 );
-      transport_read_string( tpt, err_string, len );
-      err_string[ len ] = 0;
+      helper_wait_ready( L, handle, RPC_CMD_GET );
+      helper_remote_index( tpt, helper );
 
-      deal_with_error( L, h->handle, err_string );
+      read_variable( tpt, L );
     }
 
-    freturn = 0;
+    ok = 1;
+    freturn = 1;
   }
   Catch( e )
   {
-    freturn = generic_catch_handler( L, h->handle, e );
+    ok = 0;
+    freturn = generic_catch_handler( L, helper->handle, e );
+  }
+
+  // remember the result
+  if( ok && cache )
+  {
+    if( !entry )
+    {
+      lua_createtable( L, 3, 0 );
+      lua_pushvalue( L, path );
+      lua_pushvalue( L, -2 );
+      lua_rawset( L, cache );
+      lua_insert( L, -2 );
+      entry = lua_gettop( L ) - 1;
+    }
+    lua_pushvalue( L, -1 );
+    lua_rawseti( L, entry, CACHE_VALUE );
+    lua_pushnumber( L, rpc_clock() + handle->cache_ttl );
+    lua_rawseti( L, entry, CACHE_EXPIRES );
+    lua_pushnumber( L, version );
+    lua_rawseti( L, entry, CACHE_VERSION );
   }
   return freturn;
 }
 
 
-static Helper *helper_append( lua_State *L, Helper *helper, const char *funcname )
+// **************************************************************************
+// lazy remote table proxies
+//
+//  handle.bigtable:proxy() returns a proxy userdata that fetches fields of the
+//  remote table only as they are indexed, and remembers them. # asks the
+//  server for the length once. rpc.pairs( proxy ), or pairs() on Lua 5.2+,
+//  pages through the remote table PROXY_PAGE_SIZE entries per request and
+//  remembers both the entries and their order, so later traversals are
+//  local. a proxy does not see changes to entries it has already fetched.
+//
+//  values are kept in the table referenced by vref, with the table itself
+//  standing in for remote nils. the order is kept in the table referenced by
+//  sref, which maps each key to the next one. that table also stands in for
+//  the nil key before the first entry and after the last one.
+
+static int proxy_create( lua_State *L, Helper *helper, int href )
 {
-  Helper *h = ( Helper * )lua_newuserdata( L, sizeof( Helper ) );
-  luaL_getmetatable( L, "rpc.helper" );
+  Proxy *p = ( Proxy * )lua_newuserdata( L, sizeof( Proxy ) );
+  luaL_getmetatable( L, "rpc.proxy" );
   lua_setmetatable( L, -2 );
 
-  lua_pushvalue( L, 1 ); // push parent
-  h->pref = luaL_ref( L, LUA_REGISTRYINDEX ); // put ref into struct
-  h->handle = helper->handle;
-  h->parent = helper;
-  h->nparents = helper->nparents + 1;
-  strncpy ( h->funcname, funcname, NUM_FUNCNAME_CHARS );
-  return h;
+  lua_rawgeti( L, LUA_REGISTRYINDEX, href ); // keep the helper alive
+  p->href = luaL_ref( L, LUA_REGISTRYINDEX );
+  lua_newtable( L );
+  p->vref = luaL_ref( L, LUA_REGISTRYINDEX );
+  lua_newtable( L );
+  p->sref = luaL_ref( L, LUA_REGISTRYINDEX );
+  p->helper = helper;
+  p->len = -1;
+  p->complete = 0;
+  return 1;
 }
 
-// indexing a helper returns a helper
-static int helper_index( lua_State *L )
+static int proxy_index( lua_State *L )
 {
-  const char *s;
-
-  check_num_args( L, 2 );
-  MYASSERT( lua_isuserdata( L, 1 ) && ismetatable_type( L, 1, "rpc.helper" ) );
+  struct exception e;
+  int freturn = 1;
+  Proxy *p = ( Proxy * )luaL_checkudata( L, 1, "rpc.proxy" );
+  Transport *tpt = &p->helper->handle->tpt;
+
+  lua_settop( L, 2 );
+  lua_rawgeti( L, LUA_REGISTRYINDEX, p->vref );
+  lua_pushvalue( L, 2 );
+  lua_rawget( L, 3 );
+  if( !lua_isnil( L, -1 ) || p->complete )
+  {
+    if( lua_rawequal( L, -1, 3 ) )
+      lua_pushnil( L );
+    return 1;
+  }
+  lua_pop( L, 1 );
 
-  if( lua_type( L, 2 ) != LUA_TSTRING )
-    return luaL_error( L, "can't index handle with non-string" );
-  s = lua_tostring( L, 2 );
-  if ( strlen( s ) > NUM_FUNCNAME_CHARS - 1 )
-    return luaL_error( L, errorString( ERR_LONGFNAME ) );
+  Try
+  {
+    helper_wait_ready( L, p->helper->handle, RPC_CMD_INDEX );
+    helper_remote_index( tpt, p->helper );
+    write_variable( tpt, L, 2 );
+    read_variable( tpt, L );
+  }
+  Catch( e )
+  {
+    return generic_catch_handler( L, p->helper->handle, e );
+  }
 
-  helper_append( L, ( Helper * )lua_touserdata( L, 1 ), s );
+  // remember the value, or that there was none
+  lua_pushvalue( L, 2 );
+  lua_pushvalue( L, lua_isnil( L, -2 ) ? 3 : -2 );
+  lua_rawset( L, 3 );
+  return freturn;
+}
+
+static int proxy_len( lua_State *L )
+{
+  struct exception e;
+  Proxy *p = ( Proxy * )luaL_checkudata( L, 1, "rpc.proxy" );
+  Transport *tpt = &p->helper->handle->tpt;
 
+  if( p->len < 0 )
+  {
+    Try
+    {
+      helper_wait_ready( L, p->helper->handle, RPC_CMD_LEN );
+      helper_remote_index( tpt, p->helper );
+      p->len = ( int )transport_read_u32( tpt );
+    }
+    Catch( e )
+    {
+      return generic_catch_handler( L, p->helper->handle, e );
+    }
+  }
+  lua_pushnumber( L, p->len );
   return 1;
 }
 
-static int helper_close (lua_State *L)
+// fetch the page of entries following the key at stack index key, linking
+// them into the order table at index succ and storing them in the value
+// table at index values
+static int proxy_fetch_page( lua_State *L, Proxy *p, int key, int succ, int values )
 {
-  Helper *h = ( Helper * )luaL_checkudata(L, 1, "rpc.helper");
-  luaL_argcheck(L, h, 1, "helper expected");
+  struct exception e;
+  int prev, ended = 0;
+  Transport *tpt = &p->helper->handle->tpt;
 
-  luaL_unref(L, LUA_REGISTRYINDEX, h->pref);
-  h->pref = LUA_REFNIL;
-  return 0;
-}
+  lua_pushvalue( L, lua_isnil( L, key ) ? succ : key );
+  prev = lua_gettop( L );
 
+  Try
+  {
+    helper_wait_ready( L, p->helper->handle, RPC_CMD_NEXT );
+    helper_remote_index( tpt, p->helper );
+    write_variable( tpt, L, key );
+    transport_write_u32( tpt, PROXY_PAGE_SIZE );
 
-// **************************************************************************
-// server side handle userdata objects.
+    for( ;; )
+    {
+      read_variable( tpt, L ); // key, nil ends the page
+      if( lua_isnil( L, -1 ) )
+      {
+        lua_pop( L, 1 );
+        break;
+      }
+      read_variable( tpt, L ); // value
+      lua_pushvalue( L, -2 );
+      lua_insert( L, -2 );
+      lua_rawset( L, values );
+      lua_pushvalue( L, prev );
+      lua_pushvalue( L, -2 );
+      lua_rawset( L, succ );
+      lua_replace( L, prev );
+    }
 
-static ServerHandle *server_handle_create( lua_State *L )
+    if( !transport_read_u8( tpt ) ) // reached the end of the remote table
+    {
+      lua_pushvalue( L, prev );
+      lua_pushvalue( L, succ );
+      lua_rawset( L, succ );
+      ended = 1;
+    }
+  }
+  Catch( e )
+  {
+    return generic_catch_handler( L, p->helper->handle, e );
+  }
+  lua_pop( L, 1 );
+
+  // once the order is known from the first entry to the last, every field
+  // has been seen and missing ones needn't be asked for
+  if( ended && !p->complete )
+  {
+    lua_pushvalue( L, succ );
+    for( ;; )
+    {
+      lua_rawget( L, succ );
+      if( lua_isnil( L, -1 ) || lua_rawequal( L, -1, succ ) )
+        break;
+    }
+    p->complete = !lua_isnil( L, -1 );
+    lua_pop( L, 1 );
+  }
+  return 0;
+}
+
+// iterator for rpc.pairs( proxy )
+static int proxy_next( lua_State *L )
 {
-  ServerHandle *h = ( ServerHandle * )lua_newuserdata( L, sizeof( ServerHandle ) );
-  luaL_getmetatable( L, "rpc.server_handle" );
-  lua_setmetatable( L, -2 );
+  Proxy *p = ( Proxy * )luaL_checkudata( L, 1, "rpc.proxy" );
 
-  h->link_errs = 0;
+  lua_settop( L, 2 );
+  lua_rawgeti( L, LUA_REGISTRYINDEX, p->sref );
+  lua_rawgeti( L, LUA_REGISTRYINDEX, p->vref );
 
-  transport_init( &h->ltpt );
-  transport_init( &h->atpt );
-  return h;
+  lua_pushvalue( L, lua_isnil( L, 2 ) ? 3 : 2 );
+  lua_rawget( L, 3 );
+  if( lua_isnil( L, -1 ) )
+  {
+    lua_pop( L, 1 );
+    if( proxy_fetch_page( L, p, 2, 3, 4 ) )
+      return 1; // error, nil is on the stack
+    lua_pushvalue( L, lua_isnil( L, 2 ) ? 3 : 2 );
+    lua_rawget( L, 3 );
+  }
+
+  if( lua_isnil( L, -1 ) || lua_rawequal( L, -1, 3 ) )
+  {
+    lua_pushnil( L );
+    return 1;
+  }
+  lua_pushvalue( L, -1 );
+  lua_rawget( L, 4 );
+  return 2;
 }
 
-static void server_handle_shutdown( ServerHandle *h )
+static int proxy_close( lua_State *L )
 {
-  transport_close( &h->ltpt );
-  transport_close( &h->atpt );
+  Proxy *p = ( Proxy * )luaL_checkudata( L, 1, "rpc.proxy" );
+
+  luaL_unref( L, LUA_REGISTRYINDEX, p->href );
+  luaL_unref( L, LUA_REGISTRYINDEX, p->vref );
+  luaL_unref( L, LUA_REGISTRYINDEX, p->sref );
+  p->href = p->vref = p->sref = LUA_NOREF;
+  return 0;
 }
 
-static void server_handle_destroy( ServerHandle *h )
+// rpc_pairs( proxy ) --> iterator, proxy, nil
+static int rpc_pairs( lua_State *L )
 {
-  server_handle_shutdown( h );
+  luaL_checkudata( L, 1, "rpc.proxy" );
+  lua_pushcfunction( L, proxy_next );
+  lua_pushvalue( L, 1 );
+  lua_pushnil( L );
+  return 3;
 }
 
-// **************************************************************************
-// remote function calling (client side)
-
-// rpc_connect (ip_address, port)
-//      returns a handle to the new connection, or nil if there was an error.
-//      if there is an RPC error function defined, it will be called on error.
-
 
-static int rpc_connect( lua_State *L )
+// **************************************************************************
+// streamed transfers
+//
+//  for chunk in handle.dump_log:stream( [ size ] ) do ... end
+//
+//  opens a stream of a remote value on the server and fetches it one chunk
+//  per request, so neither side needs the whole value in a single message
+//  and other commands can be issued between chunks. strings arrive as
+//  substrings of up to size bytes, tables as tables of up to size entries,
+//  and anything else as a single chunk. a zero or missing size lets the
+//  server pick STREAM_CHUNK_BYTES or STREAM_CHUNK_ENTRIES.
+
+// iterator for a stream. upvalue 1 is the helper naming the streamed
+// variable, upvalue 2 the server's stream id, or 0 once it's finished.
+static int stream_next( lua_State *L )
 {
   struct exception e;
-  Handle *handle = 0;
+  u8 more = 0;
+  Helper *h = ( Helper * )lua_touserdata( L, lua_upvalueindex( 1 ) );
+  u32 id = ( u32 )lua_tonumber( L, lua_upvalueindex( 2 ) );
+  Transport *tpt = &h->handle->tpt;
 
-  Try
+  if( id == 0 )
   {
-    handle = handle_create ( L );
-    transport_open_connection( L, handle );
+    lua_pushnil( L );
+    return 1;
+  }
 
-    transport_write_u8( &handle->tpt, RPC_CMD_CON );
-    client_negotiate( &handle->tpt );
+  Try
+  {
+    helper_wait_ready( L, h->handle, RPC_CMD_CHUNK );
+    transport_write_u32( tpt, id );
+    more = transport_read_u8( tpt );
+    if( more )
+      read_variable( tpt, L );
   }
   Catch( e )
   {
-    deal_with_error( L, 0, errorString( e.errnum ) );
+    return generic_catch_handler( L, h->handle, e );
+  }
+
+  if( !more )
+  {
+    lua_pushnumber( L, 0 );
+    lua_replace( L, lua_upvalueindex( 2 ) );
     lua_pushnil( L );
   }
   return 1;
 }
 
-
-// rpc_close( handle )
-//     this closes the transport, but does not free the handle object. that's
-//     because the handle will still be in the user's name space and might be
-//     referred to again. we'll let garbage collection free the object.
-//     it's a lua runtime error to refer to a transport after it has been closed.
-
-
-static int rpc_close( lua_State *L )
+static int stream_open( lua_State *L, Helper *helper, int href )
 {
-  check_num_args( L, 1 );
+  struct exception e;
+  u32 id = 0;
+  u32 size = ( u32 )luaL_optnumber( L, 3, 0 ); // after the helper and self
+  Transport *tpt = &helper->handle->tpt;
 
-  if( lua_isuserdata( L, 1 ) )
+  Try
   {
-    if( ismetatable_type( L, 1, "rpc.handle" ) )
-    {
-      Handle *handle = ( Handle * )lua_touserdata( L, 1 );
-      transport_close( &handle->tpt );
-      return 0;
-    }
-    if( ismetatable_type( L, 1, "rpc.server_handle" ) )
-    {
-      ServerHandle *handle = ( ServerHandle * )lua_touserdata( L, 1 );
-      server_handle_shutdown( handle );
-      return 0;
-    }
+    helper_wait_ready( L, helper->handle, RPC_CMD_STREAM );
+    helper_remote_index( tpt, helper );
+    transport_write_u32( tpt, size );
+    id = transport_read_u32( tpt );
+  }
+  Catch( e )
+  {
+    return generic_catch_handler( L, helper->handle, e );
   }
 
-  return luaL_error(L,"arg must be handle");
+  lua_rawgeti( L, LUA_REGISTRYINDEX, href );
+  lua_pushnumber( L, id );
+  lua_pushcclosure( L, stream_next, 2 );
+  return 1;
 }
 
 
-// rpc_async (handle,)
-//     this sets a handle's asynchronous calling mode (0/nil=off, other=on).
-//     (this is for the client only).
-//     @@@ Before re-enabling, this should be brought up to date with multi-command architecture
-
-// static int rpc_async (lua_State *L)
+// static int helper_async( lua_State *L )
 // {
-//   Handle *handle;
-//   check_num_args( L, 2 );
-//
-//   if ( !lua_isuserdata( L, 1 ) || !ismetatable_type( L, 1, "rpc.handle" ) )
-//     my_lua_error( L, "first arg must be client handle" );
+//     /* first read out any pending return values for old async calls */
+//     for (; h->handle->read_reply_count > 0; h->handle->read_reply_count--) {
+//       ret_code = transport_read_u8 (tpt);   /* return code */
+//       if( ret_code == 0 )
+//       {
+//         /* read return arguments, ignore everything we read */
+//         nret = transport_read_u32( tpt );
 //
-//   handle = ( Handle * )lua_touserdata( L, 1 );
+//         for (i=0; i < ( ( int ) nret ); i++)
+//           read_variable (tpt,L);
 //
-//   if ( lua_isnil( L, 2 ) || ( lua_isnumber( L, 2 ) && lua_tonumber( L, 2 ) == 0) )
-//     handle->async = 0;
-//   else
-//     handle->async = 1;
+//         lua_pop (L,nret);
+//       }
+//       else
+//       {
+//         /* read error and handle it */
+//         u32 code = transport_read_u32( tpt );
+//         u32 len = transport_read_u32( tpt );
+//         char *err_string = ( char * )alloca( len + 1 );
+//         transport_read_string( tpt, err_string, len );
+//         err_string[ len ] = 0;
 //
-//   return 0;
+//         deal_with_error( L, h->handle, err_string );
+//         freturn = 0;
+//       }
+//     }
 // }
 
-//****************************************************************************
-// lua remote function server
-//   read function call data and execute the function. this function empties the
-//   stack on entry and exit. This sets a custom error handler to catch errors
-//   around the function call.
 
-static void read_cmd_call( Transport *tpt, lua_State *L )
+
+
+// push a copy of a helper, with the same parent, for changing its options
+static Helper *helper_copy( lua_State *L, Helper *helper )
 {
-  int i, stackpos, good_function, nargs;
-  u32 len;
-  char *funcname;
-  char *token = NULL;
+  Helper *h = helper_alloc( L, helper->funcname );
+  luaL_getmetatable( L, "rpc.helper" );
+  lua_setmetatable( L, -2 );
 
-  // read function name
-  len = transport_read_u32( tpt ); /* function name string length */
-  funcname = ( char * )alloca( len + 1 );
-  transport_read_string( tpt, funcname, len );
-  funcname[ len ] = 0;
+  lua_rawgeti( L, LUA_REGISTRYINDEX, helper->pref ); // share the parent
+  h->pref = luaL_ref( L, LUA_REGISTRYINDEX );
+  h->handle = helper->handle;
+  h->parent = helper->parent;
+  h->nparents = helper->nparents;
+  h->deadline_ms = helper->deadline_ms;
+  h->hedged = helper->hedged;
+  h->pool = helper->pool;
+  return h;
+}
 
-  // get function
-  // @@@ perhaps handle more like variables instead of using a long string?
-  // @@@ also strtok is not thread safe
-  token = strtok( funcname, "." );
-  lua_getglobal( L, token );
-  if( LUA_ISCALLABLE( L, -1 ) || lua_istable( L, -1 ) ) // only continue if non-nil
-  {
-    token = strtok( NULL, "." );
+// handle.fn:with_deadline( ms ) --> helper
+//    a copy of the helper whose calls give up after ms milliseconds
+static int helper_with_deadline( lua_State *L, Helper *helper )
+{
+  u32 ms = ( u32 )luaL_checknumber( L, 3 );
 
-    // loop over remainder of string, leaving token with last value if
-    // indexing fails
-    while( token != NULL && ( LUA_ISCALLABLE( L, -1 ) || lua_istable( L, -1 ) ) )
-    {
-      lua_getfield( L, -1, token );
-      if ( LUA_ISCALLABLE( L, -1 ) || lua_istable( L, -1 ) )
-      {
-        lua_remove( L, -2 );
-        token = strtok( NULL, "." );
-      }
-    }
+  helper_copy( L, helper )->deadline_ms = ms;
+  return 1;
+}
+
+// group.fn:hedged() --> helper
+//    a copy of the helper whose calls are sent to a second replica if the
+//    first is slow. only for functions that are safe to run twice.
+static int helper_hedged( lua_State *L, Helper *helper )
+{
+  if( !helper->pool || helper->pool->shard_key )
+    return luaL_error( L, "hedged calls need a group of replicas" );
+  helper_copy( L, helper )->hedged = 1;
+  return 1;
+}
+
+// the server handle whose call is being served, innermost if a served
+// function dispatches another, for rpc.remaining() and rpc.cancelled()
+static ServerHandle *call_server = NULL;
+
+// milliseconds left before deadline, at least 1 as 0 would be no limit
+static u32 deadline_left( double deadline )
+{
+  double left = ( deadline - rpc_clock() ) * 1000;
+
+  return left > 1 ? ( u32 )left : 1;
+}
+
+// send a call to the function named by h with the arguments from stack
+// index first up. a tagged call carries an id, echoed in its reply, and the
+// milliseconds it may take (0 for no limit).
+static void helper_send_call( lua_State *L, Helper *h, int first, int tagged, u32 deadline_ms )
+{
+  Transport *tpt = &h->handle->tpt;
+  int i, n = lua_gettop( L );
+
+  if( tagged )
+  {
+    helper_wait_ready( L, h->handle, RPC_CMD_DCALL );
+    transport_write_u32( tpt, ++h->handle->call_id );
+    transport_write_u32( tpt, deadline_ms );
   }
-  stackpos = lua_gettop( L ) - 1;
-  good_function = LUA_ISCALLABLE( L, -1 );
+  else
+    helper_wait_ready( L, h->handle, RPC_CMD_CALL );
+  helper_remote_index( tpt, h );
 
-  // read number of arguments
-  nargs = transport_read_u32( tpt );
+  // write number of arguments, then each argument
+  transport_write_u32( tpt, n - first + 1 );
+  for( i = first; i <= n; i ++ )
+    write_variable( tpt, L, i );
+}
 
-  // read in each argument, leave it on the stack
-  for ( i = 0; i < nargs; i ++ )
-    read_variable( tpt, L );
+// tell the server we've given up on call id. there is no reply to the
+// cancel itself, but the call's reply still comes and is skipped.
+static void helper_send_cancel( Transport *tpt, u32 id )
+{
+  tpt->stats.commands[ RPC_CMD_CANCEL ]++;
+  transport_write_u8( tpt, RPC_CMD_CANCEL );
+  transport_write_u32( tpt, id );
+  tpt->pending++;
+}
 
-  // call the function
-  if( good_function )
+// read a call's return_value, leaving the results on the stack
+static int helper_read_reply( lua_State *L, Handle *handle )
+{
+  Transport *tpt = &handle->tpt;
+  u32 i, nret, ret_code;
+
+  // read return code
+  ret_code = transport_read_u8( tpt );
+
+  if ( ret_code == 0 )
   {
-    int nret, error_code;
-    error_code = lua_pcall( L, nargs, LUA_MULTRET, 0 );
+    // read return arguments
+    nret = transport_read_u32( tpt );
 
-    // handle errors
-    if ( error_code )
-    {
-      size_t elen;
-      const char *errmsg;
-      errmsg = lua_tolstring( L, -1, &elen );
-      transport_write_u8( tpt, 1 );
-      transport_write_u32( tpt, error_code );
-      transport_write_u32( tpt, ( u32 )elen );
-      transport_write_string( tpt, errmsg, ( int )elen );
+    for ( i = 0; i < nret; i ++ )
+      read_variable( tpt, L );
+
+    return ( int )nret;
+  }
+  else
+  {
+    // read error and handle it
+    transport_read_u32( tpt ); // read code (not being used here)
+    u32 len = transport_read_u32( tpt );
+    char *err_string = ( char * )alloca( len + 1 );
+    transport_read_string( tpt, err_string, len );
+    err_string[ len ] = 0;
+
+    deal_with_error( L, handle, err_string );
+    return 0;
+  }
+}
+
+static void helper_bind( lua_State *L, Helper *h, int first );
+static void pool_observe( Pool *pool, Handle *handle, double seconds, int failed );
+
+// handle.fn:async( ... ) --> future
+//    sends the call without waiting for its reply. only one call may be
+//    outstanding on a handle, and no other command can be sent until its
+//    future has been waited on or cancelled.
+static int future_create( lua_State *L, Helper *helper )
+{
+  struct exception e;
+  int freturn = 0;
+  Future *f;
+
+  Try
+  {
+    helper_send_call( L, helper, 3, 1, 0 );
+    f = ( Future * )lua_newuserdata( L, sizeof( Future ) );
+    luaL_getmetatable( L, "rpc.future" );
+    lua_setmetatable( L, -2 );
+    lua_pushvalue( L, 1 ); // keep the handle alive via the helper
+    f->href = luaL_ref( L, LUA_REGISTRYINDEX );
+    f->handle = helper->handle;
+    f->id = helper->handle->call_id;
+    f->state = FUTURE_WAITING;
+    f->pool = helper->pool;
+    f->sent = rpc_clock();
+    helper->handle->tpt.outstanding = f->id;
+    freturn = 1;
+  }
+  Catch( e )
+  {
+    freturn = generic_catch_handler( L, helper->handle, e );
+  }
+  return freturn;
+}
+
+// future:wait( [ seconds ] ) --> results
+//    reads the reply, raising "deadline exceeded" if it takes longer than
+//    seconds. the future can be waited on again after that.
+static int future_wait( lua_State *L )
+{
+  struct exception e;
+  int freturn = 0;
+  Future *f = ( Future * )luaL_checkudata( L, 1, "rpc.future" );
+  Transport *tpt = &f->handle->tpt;
+  double seconds = luaL_optnumber( L, 2, -1 );
+
+  if( f->state != FUTURE_WAITING )
+    return luaL_error( L, "future already collected or cancelled" );
+  if( tpt->outstanding != f->id )
+    return luaL_error( L, "future lost when its connection closed" );
+
+  Try
+  {
+    if( seconds >= 0 && !transport_wait_readable( tpt, seconds ) )
+    {
+      e.errnum = ERR_TIMEOUT;
+      e.type = nonfatal;
+      Throw( e );
+    }
+    if( transport_read_u32( tpt ) != f->id )
+    {
+      e.errnum = ERR_PROTOCOL;
+      e.type = fatal;
+      Throw( e );
+    }
+    f->state = FUTURE_DONE;
+    tpt->outstanding = 0;
+    if( f->pool )
+      pool_observe( f->pool, f->handle, rpc_clock() - f->sent, 0 );
+    lua_settop( L, 0 );
+    freturn = helper_read_reply( L, f->handle );
+  }
+  Catch( e )
+  {
+    if( f->pool && e.errnum != ERR_TIMEOUT )
+      pool_observe( f->pool, f->handle, 0, 1 );
+    freturn = generic_catch_handler( L, f->handle, e );
+  }
+  return freturn;
+}
+
+// future:cancel()
+//    asks the server to stop the call; the reply is thrown away
+static int future_cancel( lua_State *L )
+{
+  struct exception e;
+  int freturn = 0;
+  Future *f = ( Future * )luaL_checkudata( L, 1, "rpc.future" );
+
+  if( f->state != FUTURE_WAITING )
+    return 0;
+  f->state = FUTURE_CANCELLED;
+  if( f->handle->tpt.outstanding != f->id )
+    return 0; // lost with its connection, which has been reopened since
+
+  Try
+  {
+    f->handle->tpt.outstanding = 0;
+    helper_send_cancel( &f->handle->tpt, f->id );
+  }
+  Catch( e )
+  {
+    freturn = generic_catch_handler( L, f->handle, e );
+  }
+  return freturn;
+}
+
+// a future collected while waiting cancels its call, ignoring any error
+static int future_gc( lua_State *L )
+{
+  struct exception e;
+  Future *f = ( Future * )luaL_checkudata( L, 1, "rpc.future" );
+
+  if( f->state == FUTURE_WAITING && f->handle->tpt.outstanding != f->id )
+    f->state = FUTURE_CANCELLED; // lost with its connection
+  else if( f->state == FUTURE_WAITING )
+  {
+    f->state = FUTURE_CANCELLED;
+    f->handle->tpt.outstanding = 0;
+    Try
+    {
+      helper_send_cancel( &f->handle->tpt, f->id );
+    }
+    Catch( e )
+    {
+      stats_error( &f->handle->tpt, e.errnum );
+      transport_close( &f->handle->tpt );
+    }
+  }
+  luaL_unref( L, LUA_REGISTRYINDEX, f->href );
+  f->href = LUA_NOREF;
+  return 0;
+}
+
+static int helper_call_hedged( lua_State *L, Helper *h, u32 deadline_ms );
+static int helper_fanout( lua_State *L, Helper *helper );
+
+static int helper_call (lua_State *L)
+{
+  struct exception e;
+  int freturn = 0;
+  Helper *h;
+  Transport *tpt;
+  u32 deadline_ms;
+
+  h = ( Helper * )luaL_checkudata(L, 1, "rpc.helper");
+  luaL_argcheck(L, h, 1, "helper expected");
+
+  // proxies, streams and watches keep state on one connection
+  if( h->pool && h->parent && ( strcmp( "proxy", h->funcname ) == 0 ||
+                                strcmp( "stream", h->funcname ) == 0 ||
+                                strcmp( "watch", h->funcname ) == 0 ||
+                                strcmp( "unwatch", h->funcname ) == 0 ) )
+    return luaL_error( L, "%s is not available through a pool", h->funcname );
+  // methods making new helpers, and fanout, choose no connection here
+  if( !( h->parent && ( strcmp( "fanout", h->funcname ) == 0 ||
+                        strcmp( "hedged", h->funcname ) == 0 ||
+                        strcmp( "with_deadline", h->funcname ) == 0 ) ) )
+    helper_bind( L, h, h->parent && strcmp( "async", h->funcname ) == 0 ? 3 : 2 );
+
+  // a helper from a pool has no connection until bound
+  tpt = h->handle ? &h->handle->tpt : NULL;
+  deadline_ms = h->deadline_ms;
+  if( !deadline_ms && h->handle )
+    deadline_ms = h->handle->deadline_ms;
+
+  // capture special calls, otherwise execute normal remote call
+  if( h->parent && strcmp( "get", h->funcname ) == 0 )
+  {
+    helper_get( L, h->parent );
+    freturn = 1;
+  }
+  else if( h->parent && strcmp( "proxy", h->funcname ) == 0 )
+    freturn = proxy_create( L, h->parent, h->pref );
+  else if( h->parent && strcmp( "stream", h->funcname ) == 0 )
+    freturn = stream_open( L, h->parent, h->pref );
+  else if( h->parent && strcmp( "with_deadline", h->funcname ) == 0 )
+    freturn = helper_with_deadline( L, h->parent );
+  else if( h->parent && strcmp( "async", h->funcname ) == 0 )
+    freturn = future_create( L, h->parent );
+  else if( h->parent && strcmp( "hedged", h->funcname ) == 0 )
+    freturn = helper_hedged( L, h->parent );
+  else if( h->parent && strcmp( "fanout", h->funcname ) == 0 )
+    freturn = helper_fanout( L, h->parent );
+  else if( h->parent && strcmp( "watch", h->funcname ) == 0 )
+    freturn = helper_watch( L, h->parent );
+  else if( h->parent && strcmp( "unwatch", h->funcname ) == 0 )
+    freturn = helper_unwatch( L, h->parent );
+  else if( h->hedged && h->pool->nendpoints > 1 )
+    freturn = helper_call_hedged( L, h, deadline_ms );
+  else
+  {
+    double start = rpc_clock();
+
+    RPC_PROBE2( call__start, h->funcname, lua_gettop( L ) - 1 );
+    Try
+    {
+      double deadline = rpc_clock() + deadline_ms / 1000.0;
+
+      // don't wait past the deadline for replies to earlier calls
+      if( deadline_ms && tpt->pending && transport_is_open( tpt ) &&
+          !transport_wait_readable( tpt, deadline - rpc_clock() ) )
+      {
+        e.errnum = ERR_TIMEOUT;
+        e.type = nonfatal;
+        Throw( e );
+      }
+      // the server gets what is left after that wait
+      helper_send_call( L, h, 2, deadline_ms != 0, deadline_left( deadline ) );
+
+      /* if we're in async mode, we're done */
+      /*if ( h->handle->async )
+      {
+        h->handle->read_reply_count++;
+        freturn = 0;
+      }*/
+
+      // stop waiting once the deadline passes and cancel the call. the
+      // reply is still coming, so it is skipped before the next command
+      if( deadline_ms )
+      {
+        if( !transport_wait_readable( tpt, deadline - rpc_clock() ) )
+        {
+          helper_send_cancel( tpt, h->handle->call_id );
+          e.errnum = ERR_TIMEOUT;
+          e.type = nonfatal;
+          Throw( e );
+        }
+        if( transport_read_u32( tpt ) != h->handle->call_id )
+        {
+          e.errnum = ERR_PROTOCOL;
+          e.type = fatal;
+          Throw( e );
+        }
+      }
+
+      if( h->pool )
+        pool_observe( h->pool, h->handle, rpc_clock() - start, 0 );
+      freturn = helper_read_reply( L, h->handle );
+      RPC_PROBE5( call__end, h->funcname, freturn, tpt->stats.bytes_out,
+                  tpt->stats.bytes_in, 0 );
+    }
+    Catch( e )
+    {
+      RPC_PROBE5( call__end, h->funcname, 0, tpt->stats.bytes_out,
+                  tpt->stats.bytes_in, e.errnum );
+      // a missed deadline is the call's doing, not the replica's
+      if( h->pool && e.errnum != ERR_TIMEOUT )
+        pool_observe( h->pool, h->handle, 0, 1 );
+      freturn = generic_catch_handler( L, h->handle, e );
+    }
+  }
+  return freturn;
+}
+
+// __newindex even on helper,
+static int helper_newindex( lua_State *L )
+{
+  struct exception e;
+  int freturn = 0;
+  int ret_code;
+  Helper *h;
+  Transport *tpt;
+
+  h = ( Helper * )luaL_checkudata(L, -3, "rpc.helper");
+  luaL_argcheck(L, h, -3, "helper expected");
+
+  luaL_checktype(L, -2, LUA_TSTRING );
+
+  helper_bind( L, h, 0 );
+  tpt = &h->handle->tpt;
+
+  // our own assignment may change anything we've cached
+  if( h->handle->cache_ref != LUA_NOREF )
+  {
+    luaL_unref( L, LUA_REGISTRYINDEX, h->handle->cache_ref );
+    lua_newtable( L );
+    h->handle->cache_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  }
+
+  Try
+  {
+    // index destination on remote side
+    helper_wait_ready( L, h->handle, RPC_CMD_NEWINDEX );
+    helper_remote_index( tpt, h );
+
+    write_variable( tpt, L, lua_gettop( L ) - 1 );
+    write_variable( tpt, L, lua_gettop( L ) );
+
+    ret_code = transport_read_u8( tpt );
+    if( ret_code != 0 )
+    {
+      // read error and handle it
+      transport_read_u32( tpt ); // Read code (not using here)
+      u32 len = transport_read_u32( tpt );
+      char *err_string = ( char * )alloca( len + 1 );
+      transport_read_string( tpt, err_string, len );
+      err_string[ len ] = 0;
+
+      deal_with_error( L, h->handle, err_string );
+    }
+
+    freturn = 0;
+  }
+  Catch( e )
+  {
+    freturn = generic_catch_handler( L, h->handle, e );
+  }
+  return freturn;
+}
+
+
+static Helper *helper_append( lua_State *L, Helper *helper, const char *funcname )
+{
+  Helper *h = helper_alloc( L, funcname );
+  luaL_getmetatable( L, "rpc.helper" );
+  lua_setmetatable( L, -2 );
+
+  lua_pushvalue( L, 1 ); // push parent
+  h->pref = luaL_ref( L, LUA_REGISTRYINDEX ); // put ref into struct
+  h->handle = helper->handle;
+  h->parent = helper;
+  h->nparents = helper->nparents + 1;
+  h->deadline_ms = 0;
+  h->hedged = 0;
+  h->pool = helper->pool;
+  return h;
+}
+
+// indexing a helper returns a helper
+static int helper_index( lua_State *L )
+{
+  const char *s;
+
+  check_num_args( L, 2 );
+  MYASSERT( lua_isuserdata( L, 1 ) && ismetatable_type( L, 1, "rpc.helper" ) );
+
+  if( lua_type( L, 2 ) != LUA_TSTRING )
+    return luaL_error( L, "can't index handle with non-string" );
+  s = lua_tostring( L, 2 );
+
+  if( helper_cache_lookup( L ) )
+    return 1;
+
+  helper_append( L, ( Helper * )lua_touserdata( L, 1 ), s );
+  helper_cache_store( L );
+
+  return 1;
+}
+
+static int helper_close (lua_State *L)
+{
+  Helper *h = ( Helper * )luaL_checkudata(L, 1, "rpc.helper");
+  luaL_argcheck(L, h, 1, "helper expected");
+
+  luaL_unref(L, LUA_REGISTRYINDEX, h->pref);
+  h->pref = LUA_REFNIL;
+  return 0;
+}
+
+
+// **************************************************************************
+// server side handle userdata objects.
+
+static ServerHandle *server_handle_create( lua_State *L )
+{
+  ServerHandle *h = ( ServerHandle * )lua_newuserdata( L, sizeof( ServerHandle ) );
+  luaL_getmetatable( L, "rpc.server_handle" );
+  lua_setmetatable( L, -2 );
+
+  h->link_errs = 0;
+  h->streams = LUA_NOREF;
+  h->stream_seq = 0;
+  h->fstats = LUA_NOREF;
+  h->slow = NULL;
+  h->slow_ref = LUA_NOREF;
+  h->peeked = -1;
+  h->cancelled = 0;
+  h->call_tagged = 0;
+  h->call_id = 0;
+  h->call_deadline = 0;
+  h->idle_timeout = 0;
+  h->subs_ref = LUA_NOREF;
+  h->watches_ref = LUA_NOREF;
+  h->pushes_ref = LUA_NOREF;
+  h->serving = 0;
+
+  transport_init( &h->ltpt );
+  transport_init( &h->atpt );
+  h->ltpt.codec = h->atpt.codec = &generic_codec;
+  memset( &h->ltpt.stats, 0, sizeof( Stats ) );
+  memset( &h->atpt.stats, 0, sizeof( Stats ) );
+  return h;
+}
+
+static void server_handle_shutdown( ServerHandle *h )
+{
+  transport_close( &h->ltpt );
+  transport_close( &h->atpt );
+}
+
+static void server_handle_destroy( ServerHandle *h )
+{
+  server_handle_shutdown( h );
+}
+
+// **************************************************************************
+// remote function calling (client side)
+
+// rpc_connect (ip_address, port)
+//      returns a handle to the new connection, or nil if there was an error.
+//      if there is an RPC error function defined, it will be called on error.
+
+
+static int rpc_connect( lua_State *L )
+{
+  struct exception e;
+  Handle *handle = 0;
+  int i, nargs = lua_gettop( L );
+
+  // keep the arguments, to reconnect with
+  lua_createtable( L, nargs, 0 );
+  for( i = 1; i <= nargs; i ++ )
+  {
+    lua_pushvalue( L, i );
+    lua_rawseti( L, -2, i );
+  }
+  i = luaL_ref( L, LUA_REGISTRYINDEX );
+
+  Try
+  {
+    handle = handle_create ( L );
+    handle->connect_ref = i;
+    transport_open_connection( L, handle );
+
+    transport_write_u8( &handle->tpt, RPC_CMD_CON );
+    client_negotiate( &handle->tpt );
+    handle->tpt.stats.connects++;
+  }
+  Catch( e )
+  {
+    deal_with_error( L, 0, errorString( e.errnum ) );
+    lua_pushnil( L );
+  }
+  return 1;
+}
+
+
+// rpc_close( handle )
+//     this closes the transport, but does not free the handle object. that's
+//     because the handle will still be in the user's name space and might be
+//     referred to again. we'll let garbage collection free the object.
+//     it's a lua runtime error to refer to a transport after it has been closed.
+
+
+static void pool_close( lua_State *L, Pool *pool );
+
+static int rpc_close( lua_State *L )
+{
+  check_num_args( L, 1 );
+
+  if( lua_isuserdata( L, 1 ) )
+  {
+    if( ismetatable_type( L, 1, "rpc.handle" ) )
+    {
+      Handle *handle = ( Handle * )lua_touserdata( L, 1 );
+      handle->reconnect = 0;
+      transport_close( &handle->tpt );
+      return 0;
+    }
+    if( ismetatable_type( L, 1, "rpc.server_handle" ) )
+    {
+      ServerHandle *handle = ( ServerHandle * )lua_touserdata( L, 1 );
+      server_handle_shutdown( handle );
+      return 0;
+    }
+    if( ismetatable_type( L, 1, "rpc.pool" ) )
+    {
+      pool_close( L, ( Pool * )lua_touserdata( L, 1 ) );
+      return 0;
+    }
+  }
+
+  return luaL_error(L,"arg must be handle");
+}
+
+// **************************************************************************
+// connection pools and replica groups
+//
+//  a pool behaves like a handle, but each call made through it is sent on
+//  whichever of its connections is idle, opening more up to the pool's size
+//  as needed. this lets futures from async() run in parallel against a
+//  server that accepts several connections. a group is a pool spread over
+//  several identical servers (endpoints), choosing one for each call by a
+//  policy and leaving out endpoints whose calls keep failing.
+
+// a connection is healthy if it has been used recently or answers a ping
+static int pool_healthy( lua_State *L, Pool *pool, Handle *handle )
+{
+  struct exception e;
+  int healthy = 1;
+
+  if( rpc_clock() - handle->tpt.last_active < pool->check_idle )
+    return 1;
+
+  Try
+  {
+    helper_prepare( L, handle );
+    helper_ping( L, handle, pool->check_timeout );
+  }
+  Catch( e )
+  {
+    stats_error( &handle->tpt, e.errnum );
+    transport_close( &handle->tpt );
+    healthy = 0;
+  }
+  return healthy;
+}
+
+// count a call's outcome against the endpoint it went to. an endpoint is
+// left out for eject_for seconds after eject_after failures in a row.
+static void pool_observe( Pool *pool, Handle *handle, double seconds, int failed )
+{
+  Endpoint *ep = &pool->endpoints[ handle->endpoint ];
+
+  if( failed )
+  {
+    if( ++ep->failures >= pool->eject_after )
+    {
+      ep->failures = 0;
+      ep->ejected_until = rpc_clock() + pool->eject_for;
+    }
+    return;
+  }
+  ep->failures = 0;
+  ep->latency = ep->latency > 0 ? ep->latency * 0.8 + seconds * 0.2 : seconds;
+  ep->recent[ ep->nrecent++ % HEDGE_SAMPLES ] = seconds;
+}
+
+static int pool_compare( const void *a, const void *b )
+{
+  double x = *( const double * )a, y = *( const double * )b;
+  return ( x > y ) - ( x < y );
+}
+
+// the 95th percentile of an endpoint's recent call times, or -1 until
+// there are enough of them
+static double pool_p95( Endpoint *ep )
+{
+  double sorted[ HEDGE_SAMPLES ];
+  u32 n = ep->nrecent < HEDGE_SAMPLES ? ep->nrecent : HEDGE_SAMPLES;
+
+  if( n < HEDGE_MIN_SAMPLES )
+    return -1;
+  memcpy( sorted, ep->recent, n * sizeof( double ) );
+  qsort( sorted, n, sizeof( double ), pool_compare );
+  return sorted[ ( n * 95 + 99 ) / 100 - 1 ];
+}
+
+// open another connection to endpoint e. returns NULL, and ejects the
+// endpoint, if it can't be reached.
+static Handle *pool_grow( lua_State *L, Pool *pool, int e )
+{
+  Endpoint *ep = &pool->endpoints[ e ];
+  Handle *handle = NULL;
+  jmp_buf *penv = the_exception_context->penv;
+  int i, n;
+
+  lua_rawgeti( L, LUA_REGISTRYINDEX, pool->handles_ref );
+  lua_pushcfunction( L, rpc_connect );
+  lua_rawgeti( L, LUA_REGISTRYINDEX, ep->args_ref );
+  n = ( int )lua_objlen( L, -1 );
+  for( i = 1; i <= n; i ++ )
+    lua_rawgeti( L, -i, i );
+  lua_remove( L, -n - 1 );
+  // a lua error out of rpc_connect's Try leaves the exception context
+  // pointing into its frame, and a pool may be grown inside a Try
+  if( lua_pcall( L, n, 1, 0 ) != 0 )
+    the_exception_context->penv = penv; // the error message isn't a handle
+  if( lua_isuserdata( L, -1 ) )
+  {
+    handle = ( Handle * )lua_touserdata( L, -1 );
+    handle->reconnect = 1;
+    handle->endpoint = e;
+    lua_rawseti( L, -2, ( int )lua_objlen( L, -2 ) + 1 );
+  }
+  else
+  {
+    lua_pop( L, 1 ); // error message or nil
+    ep->ejected_until = rpc_clock() + pool->eject_for;
+  }
+  lua_pop( L, 1 );
+  return handle;
+}
+
+// count the calls outstanding on each endpoint, for choosing between them
+static void pool_count( lua_State *L, Pool *pool )
+{
+  Handle *handle;
+  int i, n;
+
+  for( i = 0; i < pool->nendpoints; i ++ )
+  {
+    pool->endpoints[ i ].outstanding = 0;
+    pool->endpoints[ i ].connections = 0;
+  }
+  lua_rawgeti( L, LUA_REGISTRYINDEX, pool->handles_ref );
+  n = ( int )lua_objlen( L, -1 );
+  for( i = 1; i <= n; i ++ )
+  {
+    lua_rawgeti( L, -1, i );
+    handle = ( Handle * )lua_touserdata( L, -1 );
+    pool->endpoints[ handle->endpoint ].connections++;
+    if( handle->tpt.outstanding || handle->tpt.pending )
+      pool->endpoints[ handle->endpoint ].outstanding++;
+    lua_pop( L, 1 );
+  }
+  lua_pop( L, 1 );
+}
+
+// pick a connection to endpoint e: an idle open one if there is one, else
+// a new one, else one still owed replies to cancelled calls, else a closed
+// one to be reconnected. NULL if all are busy.
+static Handle *pool_endpoint_checkout( lua_State *L, Pool *pool, int e )
+{
+  Handle *handle, *closed = NULL, *owing = NULL;
+  int i, n;
+
+  lua_rawgeti( L, LUA_REGISTRYINDEX, pool->handles_ref );
+  n = ( int )lua_objlen( L, -1 );
+  for( i = 1; i <= n; i ++ )
+  {
+    lua_rawgeti( L, -1, i );
+    handle = ( Handle * )lua_touserdata( L, -1 );
+    lua_pop( L, 1 );
+    if( handle->endpoint != e || handle->tpt.outstanding )
+      continue;
+    // the reply to a cancelled call waits for the server to stop it
+    if( transport_is_open( &handle->tpt ) && handle->tpt.pending )
+    {
+      if( !owing )
+        owing = handle;
+      continue;
+    }
+    if( transport_is_open( &handle->tpt ) && pool_healthy( L, pool, handle ) )
+    {
+      lua_pop( L, 1 );
+      return handle;
+    }
+    if( !closed )
+      closed = handle;
+  }
+  lua_pop( L, 1 );
+
+  if( pool->endpoints[ e ].connections < pool->size )
+    return pool_grow( L, pool, e );
+  return owing ? owing : closed;
+}
+
+// the lower an endpoint's score, the sooner it should answer. endpoints
+// not yet measured score 0, so they are tried.
+static double pool_score( Endpoint *ep )
+{
+  return ep->latency * ( ep->outstanding + 1 );
+}
+
+// choose an endpoint by the pool's policy from those not skipped or
+// ejected, or if every one has been ejected from those not skipped. -1 if
+// none is left.
+static int pool_choose( Pool *pool )
+{
+  int i, e, n = 0, best = -1, ejected, *c = pool->candidates;
+  double now = rpc_clock();
+
+  for( ejected = 0; ejected < 2 && n == 0; ejected ++ )
+    for( i = 0; i < pool->nendpoints; i ++ )
+      if( !pool->endpoints[ i ].skip &&
+          ( ejected || pool->endpoints[ i ].ejected_until <= now ) )
+        c[ n++ ] = i;
+  if( n == 0 )
+    return -1;
+
+  switch( pool->policy )
+  {
+    case POLICY_ROUND_ROBIN:
+      for( i = 0; i < n && best < 0; i ++ )
+        if( c[ i ] >= ( int )( pool->next % pool->nendpoints ) )
+          best = c[ i ];
+      if( best < 0 )
+        best = c[ 0 ];
+      pool->next = best + 1;
+      break;
+
+    case POLICY_LEAST:
+      for( i = 0; i < n; i ++ )
+      {
+        e = c[ i ];
+        if( best < 0 ||
+            pool->endpoints[ e ].outstanding < pool->endpoints[ best ].outstanding ||
+            ( pool->endpoints[ e ].outstanding == pool->endpoints[ best ].outstanding &&
+              pool->endpoints[ e ].latency < pool->endpoints[ best ].latency ) )
+          best = e;
+      }
+      break;
+
+    default: // POLICY_P2C, the better of two picked at random
+      best = c[ rand() % n ];
+      if( n > 1 )
+      {
+        e = c[ rand() % ( n - 1 ) ];
+        if( e == best )
+          e = c[ n - 1 ];
+        if( pool_score( &pool->endpoints[ e ] ) < pool_score( &pool->endpoints[ best ] ) )
+          best = e;
+      }
+  }
+  return best;
+}
+
+// pick a connection for the next command on any endpoint but exclude
+// (-1 for none), or NULL if there is none to be had
+static Handle *pool_checkout_other( lua_State *L, Pool *pool, int exclude )
+{
+  Handle *handle;
+  int i, e;
+
+  pool_count( L, pool );
+  for( i = 0; i < pool->nendpoints; i ++ )
+    pool->endpoints[ i ].skip = ( i == exclude );
+
+  while( ( e = pool_choose( pool ) ) >= 0 )
+  {
+    handle = pool_endpoint_checkout( L, pool, e );
+    if( handle )
+      return handle;
+    pool->endpoints[ e ].skip = 1;
+  }
+  return NULL;
+}
+
+// pick a connection for the next command
+static Handle *pool_checkout( lua_State *L, Pool *pool )
+{
+  Handle *handle = pool_checkout_other( L, pool, -1 );
+
+  if( !handle )
+    luaL_error( L, pool->nendpoints > 1 ? "no replica in the group is available" :
+                                           "every connection in the pool is busy" );
+  return handle;
+}
+
+// point a helper and its parents at a connection
+static void helper_rebind( Helper *h, Handle *handle )
+{
+  for( ; h; h = h->parent )
+    h->handle = handle;
+}
+
+// hash n bytes, continuing from hash (FNV-1a)
+static uint64_t shard_hash_bytes( uint64_t hash, const char *s, size_t n )
+{
+  if( !hash )
+    hash = 14695981039346656037ULL;
+  while( n-- )
+    hash = ( hash ^ ( u8 )*s++ ) * 1099511628211ULL;
+  return hash;
+}
+
+// spread a hash's bits, so nearby inputs give unrelated outputs
+static uint64_t shard_mix( uint64_t x )
+{
+  x = ( x ^ ( x >> 30 ) ) * 0xbf58476d1ce4e5b9ULL;
+  x = ( x ^ ( x >> 27 ) ) * 0x94d049bb133111ebULL;
+  return x ^ ( x >> 31 );
+}
+
+// hash the string or number at idx. a number hashes as its string form,
+// so 5 and "5" are the same key.
+static uint64_t shard_hash( lua_State *L, int idx )
+{
+  const char *s;
+  size_t n;
+  uint64_t hash;
+
+  if( lua_type( L, idx ) != LUA_TSTRING && lua_type( L, idx ) != LUA_TNUMBER )
+    luaL_error( L, "shard key must be a string or number, not %s", luaL_typename( L, idx ) );
+  lua_pushvalue( L, idx ); // converting a number in place would change it
+  s = lua_tolstring( L, -1, &n );
+  hash = shard_hash_bytes( 0, s, n );
+  lua_pop( L, 1 );
+  return hash;
+}
+
+// hash the rpc.connect arguments on top of the stack, naming an endpoint
+// for rendezvous hashing independent of its place in the list
+static uint64_t shard_seed( lua_State *L )
+{
+  uint64_t hash = 0;
+  int i, n = ( int )lua_objlen( L, -1 );
+  const char *s;
+  size_t len;
+
+  for( i = 1; i <= n; i ++ )
+  {
+    lua_rawgeti( L, -1, i );
+    s = lua_tolstring( L, -1, &len );
+    if( s )
+      hash = shard_hash_bytes( hash, s, len + 1 );
+    lua_pop( L, 1 );
+  }
+  return hash;
+}
+
+// the endpoint a key hash belongs to. rendezvous hashing picks the endpoint
+// scoring highest for the key; jump hashing (Lamping and Veach) moves as
+// few keys as possible when endpoints are added to the end of the list.
+static int shard_choose( Pool *pool, uint64_t hash )
+{
+  int64_t b = -1, j = 0;
+  uint64_t score, best_score = 0;
+  int i, best = 0;
+
+  if( pool->policy == POLICY_JUMP )
+  {
+    while( j < pool->nendpoints )
+    {
+      b = j;
+      hash = hash * 2862933555777941757ULL + 1;
+      j = ( int64_t )( ( b + 1 ) * ( ( double )( 1LL << 31 ) / ( double )( ( hash >> 33 ) + 1 ) ) );
+    }
+    return ( int )b;
+  }
+
+  for( i = 0; i < pool->nendpoints; i ++ )
+  {
+    score = shard_mix( hash ^ pool->endpoints[ i ].seed );
+    if( i == 0 || score > best_score )
+    {
+      best = i;
+      best_score = score;
+    }
+  }
+  return best;
+}
+
+// pick a connection to the endpoint owning the key at idx (0 for none)
+static Handle *pool_shard_checkout( lua_State *L, Pool *pool, int idx )
+{
+  Handle *handle;
+  int e;
+
+  if( idx == 0 || idx > lua_gettop( L ) )
+    luaL_error( L, "a sharded call needs argument %d as its key", pool->shard_key );
+  e = shard_choose( pool, shard_hash( L, idx ) );
+  pool_count( L, pool );
+  handle = pool_endpoint_checkout( L, pool, e );
+  if( !handle )
+    luaL_error( L, "shard %d is busy or can't be reached", e + 1 );
+  return handle;
+}
+
+// point a helper made from a pool, and its parents, at one connection.
+// first is the stack index of the call's first argument, for sharded
+// pools, or 0 if the command has no arguments.
+static void helper_bind( lua_State *L, Helper *h, int first )
+{
+  Handle *handle;
+
+  if( !h->pool )
+    return;
+  if( h->pool->shard_key )
+    handle = pool_shard_checkout( L, h->pool, first ? first + h->pool->shard_key - 1 : 0 );
+  else
+    handle = pool_checkout( L, h->pool );
+  helper_rebind( h, handle );
+}
+
+// make a hedged call: send it to one replica and, if that hasn't answered
+// within its 95th percentile call time, to a second one as well. the first
+// reply is taken and the other call cancelled. past the deadline, if there
+// is one, both are cancelled.
+static int helper_call_hedged( lua_State *L, Helper *h, u32 deadline_ms )
+{
+  struct exception e;
+  int freturn = 0;
+  Pool *pool = h->pool;
+  Handle *first = h->handle;
+  Handle * volatile second = NULL;
+  Handle *winner;
+  Transport *tpts[ 2 ];
+  double sent[ 2 ], deadline = rpc_clock() + deadline_ms / 1000.0, p95;
+  volatile int owed = 0; // bit 0 for the first call's reply, 1 the second's
+  u32 ids[ 2 ];
+  int i, n = 1;
+
+  RPC_PROBE2( call__start, h->funcname, lua_gettop( L ) - 1 );
+  Try
+  {
+    // don't wait past the deadline for replies to earlier calls
+    if( deadline_ms && first->tpt.pending && transport_is_open( &first->tpt ) &&
+        !transport_wait_readable( &first->tpt, deadline - rpc_clock() ) )
+    {
+      e.errnum = ERR_TIMEOUT;
+      e.type = nonfatal;
+      Throw( e );
+    }
+    sent[ 0 ] = rpc_clock();
+    helper_send_call( L, h, 2, 1, deadline_ms ? deadline_left( deadline ) : 0 );
+    ids[ 0 ] = first->call_id;
+    tpts[ 0 ] = &first->tpt;
+    owed = 1;
+
+    p95 = pool_p95( &pool->endpoints[ first->endpoint ] );
+    if( deadline_ms && p95 * 1000 >= deadline_ms )
+      p95 = -1; // no time left for a second try
+    if( p95 >= 0 && !transport_wait_readable( &first->tpt, p95 ) )
+    {
+      first->tpt.outstanding = ids[ 0 ]; // not to be checked out again
+      second = pool_checkout_other( L, pool, first->endpoint );
+      first->tpt.outstanding = 0;
+    }
+
+    if( second )
+    {
+      helper_rebind( h, second );
+      sent[ 1 ] = rpc_clock();
+      helper_send_call( L, h, 2, 1, deadline_ms ? deadline_left( deadline ) : 0 );
+      ids[ 1 ] = second->call_id;
+      tpts[ 1 ] = &second->tpt;
+      owed |= 2;
+      n = 2;
+      pool->endpoints[ second->endpoint ].hedges++;
+    }
+
+    // wait for a reply. calls still running at the deadline are cancelled,
+    // and their replies skipped before the next command
+    while( ( i = transport_wait_any( tpts, n, deadline_ms ? deadline - rpc_clock() :
+                                                            HEARTBEAT_TIMEOUT ) ) < 0 )
+      if( deadline_ms && rpc_clock() >= deadline )
+      {
+        for( i = 0; i < n; i ++ )
+          helper_send_cancel( tpts[ i ], ids[ i ] );
+        owed = 0;
+        e.errnum = ERR_TIMEOUT;
+        e.type = nonfatal;
+        Throw( e );
+      }
+    winner = i ? second : first;
+    if( second )
+    {
+      owed = 0;
+      if( i )
+        pool->endpoints[ second->endpoint ].hedge_wins++;
+      helper_send_cancel( tpts[ !i ], ids[ !i ] );
+      helper_rebind( h, winner );
+    }
+
+    if( transport_read_u32( &winner->tpt ) != ids[ i ] )
+    {
+      e.errnum = ERR_PROTOCOL;
+      e.type = fatal;
+      Throw( e );
+    }
+    pool_observe( pool, winner, rpc_clock() - sent[ i ], 0 );
+    freturn = helper_read_reply( L, winner );
+    RPC_PROBE5( call__end, h->funcname, freturn, winner->tpt.stats.bytes_out,
+                winner->tpt.stats.bytes_in, 0 );
+  }
+  Catch( e )
+  {
+    RPC_PROBE5( call__end, h->funcname, 0, h->handle->tpt.stats.bytes_out,
+                h->handle->tpt.stats.bytes_in, e.errnum );
+    // replies still to come on the connection that didn't fail
+    if( ( owed & 1 ) && h->handle != first )
+      first->tpt.pending++;
+    if( ( owed & 2 ) && h->handle != second )
+      second->tpt.pending++;
+    if( e.errnum != ERR_TIMEOUT )
+      pool_observe( pool, h->handle, 0, 1 );
+    freturn = generic_catch_handler( L, h->handle, e );
+  }
+  return freturn;
+}
+
+// sharded.fn:fanout( keys, ... ) --> results
+//    calls fn on every shard owning some of the list keys, passing it those
+//    keys in place of the list. the calls run in parallel and the tables
+//    they return are merged into one.
+static int helper_fanout( lua_State *L, Helper *helper )
+{
+  struct exception e;
+  int freturn = 0;
+  Pool *pool = helper->pool;
+  Endpoint *ep;
+  Handle *handle;
+  volatile int current = -1;
+  int i, n, keys, base;
+  u32 nret;
+  double start;
+
+  if( !pool || !pool->shard_key )
+    return luaL_error( L, "fanout needs a sharded group" );
+  keys = 2 + pool->shard_key;
+  luaL_checktype( L, keys, LUA_TTABLE );
+
+  // split the keys by shard, in a table kept below the call's arguments
+  lua_createtable( L, pool->nendpoints, 0 );
+  for( i = 1; i <= pool->nendpoints; i ++ )
+  {
+    lua_newtable( L );
+    lua_rawseti( L, -2, i );
+  }
+  n = ( int )lua_objlen( L, keys );
+  for( i = 1; i <= n; i ++ )
+  {
+    lua_rawgeti( L, keys, i );
+    lua_rawgeti( L, -2, shard_choose( pool, shard_hash( L, -1 ) ) + 1 );
+    lua_insert( L, -2 );
+    lua_rawseti( L, -2, ( int )lua_objlen( L, -2 ) + 1 );
+    lua_pop( L, 1 );
+  }
+  lua_insert( L, 1 );
+  lua_newtable( L ); // merged results
+  lua_insert( L, 2 );
+  lua_pushnil( L ); // first error
+  lua_insert( L, 3 );
+  keys += 3;
+
+  pool_count( L, pool );
+  for( i = 0; i < pool->nendpoints; i ++ )
+  {
+    ep = &pool->endpoints[ i ];
+    ep->fanout = NULL;
+    ep->unread = 0;
+    lua_rawgeti( L, 1, i + 1 );
+    if( lua_objlen( L, -1 ) > 0 && !( ep->fanout = pool_endpoint_checkout( L, pool, i ) ) )
+      return luaL_error( L, "shard %d is busy or can't be reached", i + 1 );
+    lua_pop( L, 1 );
+  }
+
+  start = rpc_clock();
+  Try
+  {
+    for( i = 0; i < pool->nendpoints; i ++ )
+    {
+      ep = &pool->endpoints[ i ];
+      if( !ep->fanout )
+        continue;
+      current = i;
+      lua_rawgeti( L, 1, i + 1 );
+      lua_replace( L, keys );
+      helper_rebind( helper, ep->fanout );
+      helper_send_call( L, helper, 6, 1, helper->deadline_ms ? helper->deadline_ms :
+                                                               ep->fanout->deadline_ms );
+      ep->unread = 1;
+    }
+
+    base = lua_gettop( L );
+    for( i = 0; i < pool->nendpoints; i ++ )
+    {
+      ep = &pool->endpoints[ i ];
+      if( !ep->unread )
+        continue;
+      current = i;
+      handle = ep->fanout;
+      if( transport_read_u32( &handle->tpt ) != handle->call_id )
+      {
+        e.errnum = ERR_PROTOCOL;
+        e.type = fatal;
+        Throw( e );
+      }
+      if( transport_read_u8( &handle->tpt ) == 0 )
+      {
+        for( nret = transport_read_u32( &handle->tpt ); nret > 0; nret-- )
+          read_variable( &handle->tpt, L );
+        if( lua_istable( L, base + 1 ) )
+          for( lua_pushnil( L ); lua_next( L, base + 1 ); lua_pop( L, 1 ) )
+          {
+            lua_pushvalue( L, -2 );
+            lua_insert( L, -2 );
+            lua_rawset( L, 2 );
+          }
+      }
+      else
+      {
+        transport_read_u32( &handle->tpt ); // error code
+        read_string( &handle->tpt, L, transport_read_u32( &handle->tpt ) );
+        if( lua_isnil( L, 3 ) )
+          lua_replace( L, 3 );
+      }
+      lua_settop( L, base );
+      ep->unread = 0;
+      pool_observe( pool, handle, rpc_clock() - start, 0 );
+    }
+
+    if( lua_isnil( L, 3 ) )
+    {
+      lua_pushvalue( L, 2 );
+      freturn = 1;
+    }
+  }
+  Catch( e )
+  {
+    // replies still to come on the other shards are skipped later
+    for( i = 0; i < pool->nendpoints; i ++ )
+      if( pool->endpoints[ i ].unread && i != current )
+        pool->endpoints[ i ].fanout->tpt.pending++;
+    handle = pool->endpoints[ current ].fanout;
+    pool_observe( pool, handle, 0, 1 );
+    lua_pushnil( L );
+    lua_replace( L, 3 );
+    freturn = generic_catch_handler( L, handle, e );
+  }
+
+  // a function that failed on some shard fails the whole call
+  if( !lua_isnil( L, 3 ) )
+    deal_with_error( L, helper->handle, lua_tostring( L, 3 ) );
+  return freturn;
+}
+
+// push a new pool of n endpoints, with options from the table at index
+// opts (0 for none)
+static Pool *pool_create( lua_State *L, int n, int opts )
+{
+  static const char *const policies[] = { "round_robin", "least", "p2c",
+                                          "rendezvous", "jump", NULL };
+  Pool *pool;
+  int i;
+
+  pool = ( Pool * )lua_newuserdata( L, sizeof( Pool ) + n * ( sizeof( Endpoint ) + sizeof( int ) ) );
+  luaL_getmetatable( L, "rpc.pool" );
+  lua_setmetatable( L, -2 );
+  pool->nendpoints = n;
+  pool->candidates = ( int * )&pool->endpoints[ n ];
+  pool->size = n > 1 ? 1 : 4;
+  pool->warm = 1;
+  pool->policy = POLICY_P2C;
+  pool->next = 0;
+  pool->check_idle = 10;
+  pool->check_timeout = HEARTBEAT_TIMEOUT;
+  pool->eject_after = 3;
+  pool->eject_for = 10;
+  pool->shard_key = 0;
+  pool->handles_ref = LUA_NOREF;
+  memset( pool->endpoints, 0, n * sizeof( Endpoint ) );
+  for( i = 0; i < n; i ++ )
+    pool->endpoints[ i ].args_ref = LUA_NOREF;
+
+  if( opts )
+  {
+    lua_getfield( L, opts, "size" );
+    pool->size = ( int )luaL_optnumber( L, -1, pool->size );
+    lua_getfield( L, opts, "warm" );
+    pool->warm = ( int )luaL_optnumber( L, -1, pool->warm );
+    lua_getfield( L, opts, "check_idle" );
+    pool->check_idle = luaL_optnumber( L, -1, pool->check_idle );
+    lua_getfield( L, opts, "check_timeout" );
+    pool->check_timeout = luaL_optnumber( L, -1, pool->check_timeout );
+    lua_getfield( L, opts, "eject_after" );
+    pool->eject_after = ( u32 )luaL_optnumber( L, -1, pool->eject_after );
+    lua_getfield( L, opts, "eject_for" );
+    pool->eject_for = luaL_optnumber( L, -1, pool->eject_for );
+    lua_getfield( L, opts, "policy" );
+    pool->policy = luaL_checkoption( L, -1, "p2c", policies );
+    lua_getfield( L, opts, "key" );
+    if( pool->policy >= POLICY_RENDEZVOUS )
+      pool->shard_key = ( int )luaL_optnumber( L, -1, 1 );
+    lua_pop( L, 8 );
+  }
+  if( pool->shard_key < 0 )
+    luaL_error( L, "shard key must be an argument position" );
+  if( pool->size < 1 )
+    luaL_error( L, "pool size must be at least 1" );
+
+  lua_createtable( L, n * pool->size, 0 );
+  pool->handles_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  return pool;
+}
+
+// open each endpoint's warm connections
+static void pool_warm( lua_State *L, Pool *pool )
+{
+  int i, e;
+
+  for( e = 0; e < pool->nendpoints; e ++ )
+    for( i = 0; i < pool->warm && i < pool->size; i ++ )
+      if( !pool_grow( L, pool, e ) )
+        break;
+}
+
+// rpc_pool( address..., { size = n, warm = n, check_idle = s, check_timeout = s } )
+//    a handle-like pool of up to size connections, made with the same
+//    arguments as rpc.connect. warm connections are opened straight away.
+//    a connection idle for check_idle seconds is pinged before use.
+static int rpc_pool_create( lua_State *L )
+{
+  int i, nargs = lua_gettop( L ), opts = 0;
+  Pool *pool;
+
+  if( nargs > 0 && lua_istable( L, nargs ) )
+    opts = nargs--;
+  pool = pool_create( L, 1, opts );
+
+  lua_createtable( L, nargs, 0 );
+  for( i = 1; i <= nargs; i ++ )
+  {
+    lua_pushvalue( L, i );
+    lua_rawseti( L, -2, i );
+  }
+  pool->endpoints[ 0 ].args_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+
+  pool_warm( L, pool );
+  if( pool->warm > 0 && pool->endpoints[ 0 ].ejected_until > 0 )
+    return luaL_error( L, "pool could not connect" );
+  return 1;
+}
+
+// rpc_connect_group( { endpoint, ... } [, options ] )
+//    a handle-like group of identical servers. each endpoint is a table of
+//    rpc.connect arguments, or a single address string. options are those
+//    of rpc.pool, size being per endpoint (1), and
+//      policy       "round_robin", "least" (fewest calls outstanding, then
+//                   lowest latency) or "p2c" (the better of two endpoints
+//                   picked at random, by latency times calls outstanding)
+//                   "rendezvous" or "jump" (consistent hashing of the call
+//                   argument at position key, so each key has one endpoint)
+//      key          argument hashed by the hashing policies (1)
+//      eject_after  transport failures in a row that eject an endpoint (3)
+//      eject_for    seconds an ejected endpoint is left out (10)
+static int rpc_connect_group( lua_State *L )
+{
+  int e, n;
+  Pool *pool;
+
+  luaL_checktype( L, 1, LUA_TTABLE );
+  n = ( int )lua_objlen( L, 1 );
+  if( n < 1 )
+    return luaL_error( L, "a group needs at least one endpoint" );
+  pool = pool_create( L, n, lua_istable( L, 2 ) ? 2 : 0 );
+
+  for( e = 0; e < n; e ++ )
+  {
+    lua_rawgeti( L, 1, e + 1 );
+    if( !lua_istable( L, -1 ) )
+    {
+      lua_createtable( L, 1, 0 );
+      lua_insert( L, -2 );
+      lua_rawseti( L, -2, 1 );
+    }
+    pool->endpoints[ e ].seed = shard_seed( L );
+    pool->endpoints[ e ].args_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  }
+
+  pool_warm( L, pool );
+  return 1;
+}
+
+// rpc_endpoints( pool ) --> { { latency, connections, outstanding, ejected }, ... }
+//    the state of each endpoint of a pool or group. latency is a moving
+//    average of call times in seconds, 0 until a call has completed.
+static int rpc_endpoints( lua_State *L )
+{
+  Pool *pool = ( Pool * )luaL_checkudata( L, 1, "rpc.pool" );
+  Endpoint *ep;
+  int i;
+
+  pool_count( L, pool );
+  lua_createtable( L, pool->nendpoints, 0 );
+  for( i = 0; i < pool->nendpoints; i ++ )
+  {
+    ep = &pool->endpoints[ i ];
+    lua_createtable( L, 0, 4 );
+    lua_pushnumber( L, ep->latency );
+    lua_setfield( L, -2, "latency" );
+    lua_pushnumber( L, ep->hedges );
+    lua_setfield( L, -2, "hedges" );
+    lua_pushnumber( L, ep->hedge_wins );
+    lua_setfield( L, -2, "hedge_wins" );
+    lua_pushnumber( L, ep->connections );
+    lua_setfield( L, -2, "connections" );
+    lua_pushnumber( L, ep->outstanding );
+    lua_setfield( L, -2, "outstanding" );
+    lua_pushboolean( L, ep->ejected_until > rpc_clock() );
+    lua_setfield( L, -2, "ejected" );
+    lua_rawseti( L, -2, i + 1 );
+  }
+  return 1;
+}
+
+// indexing a pool returns a helper, bound to a connection when used
+static int pool_index( lua_State *L )
+{
+  Helper *h;
+
+  check_num_args( L, 2 );
+  if( lua_type( L, 2 ) != LUA_TSTRING )
+    return luaL_error( L, "can't index a pool with a non-string" );
+
+  if( helper_cache_lookup( L ) )
+    return 1;
+
+  h = helper_create( L, NULL, lua_tostring( L, 2 ) );
+  h->pool = ( Pool * )lua_touserdata( L, 1 );
+  helper_cache_store( L );
+  return 1;
+}
+
+static int pool_newindex( lua_State *L )
+{
+  Helper *h;
+
+  check_num_args( L, 3 );
+  if( lua_type( L, 2 ) != LUA_TSTRING )
+    return luaL_error( L, "can't index a pool with a non-string" );
+
+  h = helper_create( L, NULL, "" );
+  h->pool = ( Pool * )lua_touserdata( L, 1 );
+  lua_replace( L, 1 );
+
+  helper_newindex( L );
+  return 0;
+}
+
+// close every connection in the pool
+static void pool_close( lua_State *L, Pool *pool )
+{
+  Handle *handle;
+  int i, n;
+
+  lua_rawgeti( L, LUA_REGISTRYINDEX, pool->handles_ref );
+  n = lua_istable( L, -1 ) ? ( int )lua_objlen( L, -1 ) : 0;
+  for( i = 1; i <= n; i ++ )
+  {
+    lua_rawgeti( L, -1, i );
+    handle = ( Handle * )lua_touserdata( L, -1 );
+    handle->reconnect = 0;
+    transport_close( &handle->tpt );
+    lua_pop( L, 1 );
+  }
+  lua_pop( L, 1 );
+}
+
+static int pool_gc( lua_State *L )
+{
+  Pool *pool = ( Pool * )luaL_checkudata( L, 1, "rpc.pool" );
+  int i;
+
+  pool_close( L, pool );
+  for( i = 0; i < pool->nendpoints; i ++ )
+  {
+    luaL_unref( L, LUA_REGISTRYINDEX, pool->endpoints[ i ].args_ref );
+    pool->endpoints[ i ].args_ref = LUA_NOREF;
+  }
+  luaL_unref( L, LUA_REGISTRYINDEX, pool->handles_ref );
+  pool->handles_ref = LUA_NOREF;
+  return 0;
+}
+
+
+// rpc_async (handle,)
+//     this sets a handle's asynchronous calling mode (0/nil=off, other=on).
+//     (this is for the client only).
+//     @@@ Before re-enabling, this should be brought up to date with multi-command architecture
+
+// static int rpc_async (lua_State *L)
+// {
+//   Handle *handle;
+//   check_num_args( L, 2 );
+//
+//   if ( !lua_isuserdata( L, 1 ) || !ismetatable_type( L, 1, "rpc.handle" ) )
+//     my_lua_error( L, "first arg must be client handle" );
+//
+//   handle = ( Handle * )lua_touserdata( L, 1 );
+//
+//   if ( lua_isnil( L, 2 ) || ( lua_isnumber( L, 2 ) && lua_tonumber( L, 2 ) == 0) )
+//     handle->async = 0;
+//   else
+//     handle->async = 1;
+//
+//   return 0;
+// }
+
+//****************************************************************************
+// lua remote function server
+//   read function call data and execute the function. this function empties the
+//   stack on entry and exit. This sets a custom error handler to catch errors
+//   around the function call.
+
+// histogram bucket holding a time in seconds
+static int fstats_bucket( double seconds )
+{
+  double us = seconds * 1e6;
+  int e, b;
+
+  if( us < 16 )
+    return us < 0 ? 0 : ( int )us;
+  frexp( us, &e ); // us is in [ 2^(e-1), 2^e )
+  b = ( e - 4 ) * 16 + ( int )ldexp( us, 5 - e ) - 16;
+  return b < FSTAT_BUCKETS ? b : FSTAT_BUCKETS - 1;
+}
+
+// smallest time in microseconds that falls in a bucket
+static double fstats_value( int b )
+{
+  return b < 16 ? b : ldexp( b % 16 + 16, b / 16 - 1 );
+}
+
+// find the stats of a function, creating them on its first call
+static FuncStats *fstats_lookup( lua_State *L, ServerHandle *handle, const char *name )
+{
+  FuncStats *fs;
+
+  if( handle->fstats == LUA_NOREF )
+  {
+    lua_newtable( L );
+    handle->fstats = luaL_ref( L, LUA_REGISTRYINDEX );
+  }
+  lua_rawgeti( L, LUA_REGISTRYINDEX, handle->fstats );
+  lua_getfield( L, -1, name );
+  fs = ( FuncStats * )lua_touserdata( L, -1 );
+  lua_pop( L, 1 );
+  if( fs == NULL )
+  {
+    fs = ( FuncStats * )lua_newuserdata( L, sizeof( FuncStats ) );
+    memset( fs, 0, sizeof( FuncStats ) );
+    lua_setfield( L, -2, name );
+  }
+  lua_pop( L, 1 );
+  return fs;
+}
+
+static void fstats_record( FuncStats *fs, int phase, double seconds )
+{
+  fs->total[ phase ] += seconds;
+  if( seconds > fs->max[ phase ] )
+    fs->max[ phase ] = seconds;
+  fs->buckets[ phase ][ fstats_bucket( seconds ) ]++;
+}
+
+// remember a call that went over the slow call threshold
+static void slow_log_record( ServerHandle *handle, const char *path,
+                             const double *t, u32 request_bytes, u32 reply_bytes )
+{
+  SlowLog *log = handle->slow;
+  SlowCall *c = &log->calls[ log->count++ % log->size ];
+  int i;
+
+  c->at = ( double )time( NULL );
+  for( i = 0; i < FSTAT_PHASES; i ++ )
+    c->phase[ i ] = t[ i + 1 ] - t[ i ];
+  c->request_bytes = request_bytes;
+  c->reply_bytes = reply_bytes;
+  strncpy( c->path, path, SLOW_NAME_CHARS - 1 );
+  c->path[ SLOW_NAME_CHARS - 1 ] = 0;
+  transport_peer_name( &handle->atpt, c->peer, SLOW_NAME_CHARS );
+}
+
+// look through what has already arrived for a cancel of call id, without
+// blocking. the client sends nothing else while it waits for a reply, but
+// once it gives up its next command may follow the cancel; that command is
+// kept for the dispatcher.
+static int server_check_cancel( ServerHandle *handle, u32 id )
+{
+  Transport *tpt = &handle->atpt;
+
+  while( !handle->cancelled && handle->peeked < 0 &&
+         transport_wait_readable( tpt, 0 ) )
+  {
+    u8 cmd = transport_read_u8( tpt );
+    if( cmd == RPC_CMD_CANCEL )
+    {
+      tpt->stats.commands[ RPC_CMD_CANCEL ]++;
+      if( transport_read_u32( tpt ) == id )
+        handle->cancelled = 1;
+    }
+    else
+      handle->peeked = cmd;
+  }
+  return handle->cancelled;
+}
+
+// serve a call. a call with a deadline (tagged) carries an id, echoed at the
+// start of the reply, and the milliseconds it may take. if they have run out
+// by the time the arguments are read the function isn't called.
+static void read_cmd_call( ServerHandle *handle, lua_State *L, int tagged )
+{
+  Transport *tpt = &handle->atpt;
+  int i, stackpos, good_function, expired = 0, nargs, error_code = 0;
+  u32 len, id = 0;
+  char *funcname, *path;
+  char *token = NULL;
+  double t[ FSTAT_PHASES + 1 ], deadline = 0;
+  uint64_t bytes_in = tpt->stats.bytes_in, bytes_out = tpt->stats.bytes_out;
+
+  if( tagged )
+  {
+    u32 budget;
+    id = transport_read_u32( tpt );
+    budget = transport_read_u32( tpt );
+    if( budget )
+      deadline = rpc_clock() + budget / 1000.0;
+  }
+  handle->cancelled = 0;
+
+  // read function name
+  len = transport_read_u32( tpt ); /* function name string length */
+  funcname = ( char * )alloca( len + 1 );
+  transport_read_string( tpt, funcname, len );
+  funcname[ len ] = 0;
+  path = ( char * )alloca( len + 1 );
+  strcpy( path, funcname );
+  t[ FSTAT_DECODE ] = rpc_clock();
+  RPC_PROBE1( serve__start, path );
+
+  // get function
+  // @@@ perhaps handle more like variables instead of using a long string?
+  // @@@ also strtok is not thread safe
+  token = strtok( funcname, "." );
+  lua_getglobal( L, token );
+  if( LUA_ISCALLABLE( L, -1 ) || lua_istable( L, -1 ) ) // only continue if non-nil
+  {
+    token = strtok( NULL, "." );
+
+    // loop over remainder of string, leaving token with last value if
+    // indexing fails
+    while( token != NULL && ( LUA_ISCALLABLE( L, -1 ) || lua_istable( L, -1 ) ) )
+    {
+      lua_getfield( L, -1, token );
+      if ( LUA_ISCALLABLE( L, -1 ) || lua_istable( L, -1 ) )
+      {
+        lua_remove( L, -2 );
+        token = strtok( NULL, "." );
+      }
+    }
+  }
+  stackpos = lua_gettop( L ) - 1;
+  good_function = LUA_ISCALLABLE( L, -1 );
+
+  // read number of arguments
+  nargs = transport_read_u32( tpt );
+
+  // read in each argument, leave it on the stack
+  for ( i = 0; i < nargs; i ++ )
+    read_variable( tpt, L );
+  t[ FSTAT_CALL ] = rpc_clock();
+
+  // a call that expired or was cancelled while queued isn't made
+  if( tagged )
+  {
+    if( deadline && t[ FSTAT_CALL ] >= deadline )
+    {
+      expired = ERR_TIMEOUT;
+      tpt->stats.expired++;
+    }
+    else if( server_check_cancel( handle, id ) )
+    {
+      expired = ERR_CANCELLED;
+      tpt->stats.cancelled++;
+    }
+    transport_write_u32( tpt, id );
+  }
+
+  // call the function
+  if( expired )
+  {
+    const char *msg = errorString( expired );
+    transport_write_u8( tpt, 1 );
+    transport_write_u32( tpt, LUA_ERRRUN );
+    transport_write_u32( tpt, ( u32 )strlen( msg ) );
+    transport_write_string( tpt, msg, ( int )strlen( msg ) );
+  }
+  else if( good_function )
+  {
+    int nret;
+    ServerHandle *outer = call_server;
+    call_server = handle;
+    handle->call_tagged = tagged;
+    handle->call_id = id;
+    handle->call_deadline = deadline;
+    error_code = lua_pcall( L, nargs, LUA_MULTRET, 0 );
+    handle->call_tagged = 0;
+    handle->call_deadline = 0;
+    call_server = outer;
+    if( handle->cancelled )
+      tpt->stats.cancelled++;
+    t[ FSTAT_ENCODE ] = rpc_clock();
+
+    // handle errors
+    if ( error_code )
+    {
+      size_t elen;
+      const char *errmsg;
+      errmsg = lua_tolstring( L, -1, &elen );
+      transport_write_u8( tpt, 1 );
+      transport_write_u32( tpt, error_code );
+      transport_write_u32( tpt, ( u32 )elen );
+      transport_write_string( tpt, errmsg, ( int )elen );
+    }
+    else
+    {
+      // pass the return values back to the caller
+      transport_write_u8( tpt, 0 );
+      nret = lua_gettop( L ) - stackpos;
+      transport_write_u32( tpt, nret );
+      for ( i = 0; i < nret; i ++ )
+        write_variable( tpt, L, stackpos + 1 + i );
+    }
+    t[ FSTAT_PHASES ] = rpc_clock();
+  }
+  else
+  {
+    // bad index or function call
+    const char *msg;
+    if ( lua_isnil( L, -1 ) )
+      msg = "undefined: ";
+    else if ( lua_istable( L, -1 ) )
+      msg = "attempted to call table";
+    else
+      msg = "not table/function: ";
+    if( token == NULL ) // should occur if "function" was actually a table
+      token = "";
+    int errlen = ( int )strlen( msg ) + strlen( token );
+    transport_write_u8( tpt, 1 );
+    transport_write_u32( tpt, LUA_ERRRUN );
+    transport_write_u32( tpt, errlen );
+    transport_write_string( tpt, msg, ( int )strlen( msg ) );
+    transport_write_string( tpt, token, strlen( token ) );
+  }
+  // empty the stack
+  lua_settop ( L, 0 );
+  RPC_PROBE4( serve__end, path, good_function && !expired ? error_code : LUA_ERRRUN,
+              tpt->stats.bytes_in - bytes_in, tpt->stats.bytes_out - bytes_out );
+
+  if( good_function && !expired )
+  {
+    FuncStats *fs = fstats_lookup( L, handle, path );
+    fs->calls++;
+    if( error_code )
+      fs->errors++;
+    for( i = 0; i < FSTAT_PHASES; i ++ )
+      fstats_record( fs, i, t[ i + 1 ] - t[ i ] );
+
+    if( handle->slow && t[ FSTAT_PHASES ] - t[ 0 ] >= handle->slow->threshold )
+      slow_log_record( handle, path, t, ( u32 )( tpt->stats.bytes_in - bytes_in ),
+                       ( u32 )( tpt->stats.bytes_out - bytes_out ) );
+  }
+}
+
+
+// push the value found by following a dotted path from the globals.
+// the path string is modified.
+static void push_path_value( lua_State *L, char *path )
+{
+  char *token = NULL;
+
+  // @@@ perhaps handle more like variables instead of using a long string?
+  // @@@ also strtok is not thread safe
+  token = strtok( path, "." );
+  lua_getglobal( L, token );
+  token = strtok( NULL, "." );
+  while( token != NULL )
+  {
+    lua_getfield( L, -1, token );
+    lua_remove( L, -2 );
+    token = strtok( NULL, "." );
+  }
+}
+
+static void read_cmd_get( Transport *tpt, lua_State *L )
+{
+  u32 len;
+  char *funcname;
+
+  // read function name
+  len = transport_read_u32( tpt ); // function name string length
+  funcname = ( char * )alloca( len + 1 );
+  transport_read_string( tpt, funcname, len );
+  funcname[ len ] = 0;
+
+  push_path_value( L, funcname );
+
+  // return top value on stack
+  write_variable( tpt, L, lua_gettop( L ) );
+
+  // empty the stack
+  lua_settop ( L, 0 );
+}
+
+
+// version stamps for get() revalidation
+//   the registry table "rpc.versions" maps remote paths to the value of a
+//   counter (kept at index 0) when they were last assigned through
+//   read_cmd_newindex. an assignment stamps the assigned path and all of its
+//   prefixes, and the version of a path is the newest stamp on it or any of
+//   its prefixes, so assigning either a parent or a child invalidates it.
+//   changes made directly by server-side code are not tracked, unless made
+//   with rpc.set.
+
+static void versions_push( lua_State *L )
+{
+  lua_getfield( L, LUA_REGISTRYINDEX, "rpc.versions" );
+  if( lua_isnil( L, -1 ) )
+  {
+    lua_pop( L, 1 );
+    lua_newtable( L );
+    lua_pushvalue( L, -1 );
+    lua_setfield( L, LUA_REGISTRYINDEX, "rpc.versions" );
+  }
+}
+
+// stamp a path and each of its prefixes with a new version
+static void version_bump( lua_State *L, const char *path, size_t len )
+{
+  size_t i;
+  lua_Number stamp;
+
+  versions_push( L );
+  lua_rawgeti( L, -1, 0 );
+  stamp = lua_tonumber( L, -1 ) + 1;
+  lua_pop( L, 1 );
+  lua_pushnumber( L, stamp );
+  lua_rawseti( L, -2, 0 );
+
+  for( i = 1; i <= len; i ++ )
+    if( i == len || path[ i ] == '.' )
+    {
+      lua_pushlstring( L, path, i );
+      lua_pushnumber( L, stamp );
+      lua_rawset( L, -3 );
+    }
+  lua_pop( L, 1 );
+}
+
+// current version of a path. this is never 0, which clients use to mean
+// that they have nothing cached.
+static u32 version_lookup( lua_State *L, const char *path, size_t len )
+{
+  size_t i;
+  lua_Number v = 0;
+
+  versions_push( L );
+  for( i = 1; i <= len; i ++ )
+    if( i == len || path[ i ] == '.' )
+    {
+      lua_pushlstring( L, path, i );
+      lua_rawget( L, -2 );
+      if( lua_tonumber( L, -1 ) > v )
+        v = lua_tonumber( L, -1 );
+      lua_pop( L, 1 );
+    }
+  lua_pop( L, 1 );
+  return ( u32 )v + 1;
+}
+
+
+// get a variable only if it changed since the version the client has
+static void read_cmd_getv( Transport *tpt, lua_State *L )
+{
+  u32 len, version, current;
+  char *funcname;
+
+  // read function name and cached version
+  len = transport_read_u32( tpt ); // function name string length
+  funcname = ( char * )alloca( len + 1 );
+  transport_read_string( tpt, funcname, len );
+  funcname[ len ] = 0;
+  version = transport_read_u32( tpt );
+
+  current = version_lookup( L, funcname, len );
+  if( version == current )
+    transport_write_u8( tpt, 0 );
+  else
+  {
+    push_path_value( L, funcname );
+    transport_write_u8( tpt, 1 );
+    transport_write_u32( tpt, current );
+    write_variable( tpt, L, lua_gettop( L ) );
+  }
+
+  // empty the stack
+  lua_settop ( L, 0 );
+}
+
+
+static void server_notify_watchers( lua_State *L, ServerHandle *handle, const char *path );
+
+static void read_cmd_newindex( ServerHandle *handle, lua_State *L )
+{
+  Transport *tpt = &handle->atpt;
+  u32 len;
+  char *funcname, *path, *changed;
+  char *token = NULL;
+  int key;
+
+  // read function name
+  len = transport_read_u32( tpt ); // function name string length
+  funcname = ( char * )alloca( len + 1 );
+  transport_read_string( tpt, funcname, len );
+  funcname[ len ] = 0;
+
+  // keep an intact copy for versioning, strtok will split funcname
+  path = ( char * )alloca( len + 1 );
+  memcpy( path, funcname, len + 1 );
+
+  // get function
+  // @@@ perhaps handle more like variables instead of using a long string?
+  // @@@ also strtok is not thread safe
+  if( strlen( funcname ) > 0 )
+  {
+    token = strtok( funcname, "." );
+    lua_getglobal( L, token );
+    token = strtok( NULL, "." );
+    while( token != NULL )
+    {
+      lua_getfield( L, -1, token );
+      lua_remove( L, -2 );
+      token = strtok( NULL, "." );
+    }
+  }
+  read_variable( tpt, L ); // key
+  read_variable( tpt, L ); // value
+
+  // the path assigned, or the table's own for keys that aren't strings
+  key = lua_gettop( L ) - 1;
+  changed = path;
+  if( lua_type( L, key ) == LUA_TSTRING )
+  {
+    changed = ( char * )alloca( len + lua_strlen( L, key ) + 2 );
+    sprintf( changed, *path ? "%s.%s" : "%s%s", path, lua_tostring( L, key ) );
+  }
+  if( *changed )
+    version_bump( L, changed, strlen( changed ) );
+
+  if( *path )
+    lua_settable( L, -3 ); // set key to value on indexed table
+  else
+    lua_setglobal( L, lua_tostring( L, -2 ) );
+  if( *changed )
+    server_notify_watchers( L, handle, changed );
+  // Write out 0 to indicate no error and that we're done
+  transport_write_u8( tpt, 0 );
+
+  // if ( error_code ) // Add some error handling later
+  // {
+  //   size_t len;
+  //   const char *errmsg;
+  //   errmsg = lua_tolstring (L, -1, &len);
+  //   transport_write_u8( tpt, 1 );
+  //   transport_write_u32( tpt, error_code );
+  //   transport_write_u32( tpt, len );
+  //   transport_write_string( tpt, errmsg, len );
+  // }
+
+  // empty the stack
+  lua_settop ( L, 0 );
+}
+
+
+// index a remote table with a single key of any type
+static void read_cmd_index( Transport *tpt, lua_State *L )
+{
+  u32 len;
+  char *funcname;
+
+  // read table name and key
+  len = transport_read_u32( tpt ); // table name string length
+  funcname = ( char * )alloca( len + 1 );
+  transport_read_string( tpt, funcname, len );
+  funcname[ len ] = 0;
+
+  push_path_value( L, funcname );
+  read_variable( tpt, L );
+
+  if( lua_istable( L, -2 ) )
+    lua_gettable( L, -2 );
+  else
+    lua_pushnil( L );
+  write_variable( tpt, L, lua_gettop( L ) );
+
+  // empty the stack
+  lua_settop ( L, 0 );
+}
+
+
+// return up to a requested number of entries following a key in a remote
+// table, followed by a nil and a flag saying whether there may be more
+static void read_cmd_next( Transport *tpt, lua_State *L )
+{
+  u32 len, max, n = 0;
+  char *funcname;
+  int table;
+
+  // read table name, key and page size
+  len = transport_read_u32( tpt ); // table name string length
+  funcname = ( char * )alloca( len + 1 );
+  transport_read_string( tpt, funcname, len );
+  funcname[ len ] = 0;
+
+  push_path_value( L, funcname );
+  table = lua_gettop( L );
+  read_variable( tpt, L );
+  max = transport_read_u32( tpt );
+
+  // a key that has since been removed can't be continued from, so it ends
+  // the traversal
+  if( lua_istable( L, table ) && !lua_isnil( L, -1 ) )
+  {
+    lua_pushvalue( L, -1 );
+    lua_rawget( L, table );
+    if( lua_isnil( L, -1 ) )
+      lua_settop( L, table );
+    else
+      lua_pop( L, 1 );
+  }
+
+  if( lua_istable( L, table ) && lua_gettop( L ) > table )
+    while( n < max && lua_next( L, table ) )
+    {
+      write_variable( tpt, L, lua_gettop( L ) - 1 );
+      write_variable( tpt, L, lua_gettop( L ) );
+      lua_pop( L, 1 );
+      n ++;
+    }
+
+  transport_write_u8( tpt, RPC_NIL );
+  transport_write_u8( tpt, max > 0 && n == max );
+
+  // empty the stack
+  lua_settop ( L, 0 );
+}
+
+
+// return the length of a remote table or string
+static void read_cmd_len( Transport *tpt, lua_State *L )
+{
+  u32 len;
+  char *funcname;
+
+  // read variable name
+  len = transport_read_u32( tpt ); // variable name string length
+  funcname = ( char * )alloca( len + 1 );
+  transport_read_string( tpt, funcname, len );
+  funcname[ len ] = 0;
+
+  push_path_value( L, funcname );
+  transport_write_u32( tpt, ( u32 )lua_objlen( L, -1 ) );
+
+  // empty the stack
+  lua_settop ( L, 0 );
+}
+
+
+// server side of streamed transfers
+//   each connection has a table of open streams, keyed by id. a stream is a
+//   table holding the value, the position reached (a string offset or the
+//   last table key sent), the chunk size and a finished flag. opening a
+//   stream closes the one opened MAX_STREAMS before it, which bounds the
+//   state kept for clients that abandon streams part way.
+
+enum { STREAM_VALUE = 1, STREAM_POS, STREAM_SIZE, STREAM_DONE };
+
+static void server_streams_push( lua_State *L, ServerHandle *handle )
+{
+  if( handle->streams == LUA_NOREF )
+  {
+    lua_newtable( L );
+    handle->streams = luaL_ref( L, LUA_REGISTRYINDEX );
+  }
+  lua_rawgeti( L, LUA_REGISTRYINDEX, handle->streams );
+}
+
+// drop all streams, when the connection they belong to goes away
+static void server_streams_reset( lua_State *L, ServerHandle *handle )
+{
+  luaL_unref( L, LUA_REGISTRYINDEX, handle->streams );
+  handle->streams = LUA_NOREF;
+}
+
+// forget subscriptions and undelivered events, when the connection they
+// belong to goes away
+static void server_push_reset( lua_State *L, ServerHandle *handle )
+{
+  luaL_unref( L, LUA_REGISTRYINDEX, handle->subs_ref );
+  luaL_unref( L, LUA_REGISTRYINDEX, handle->watches_ref );
+  luaL_unref( L, LUA_REGISTRYINDEX, handle->pushes_ref );
+  handle->subs_ref = LUA_NOREF;
+  handle->watches_ref = LUA_NOREF;
+  handle->pushes_ref = LUA_NOREF;
+  handle->serving = 0;
+}
+
+// record a subscription to a topic (subs) or a watch on a path (watches,
+// mapping the path to its WATCH_* op)
+static void read_cmd_subscribe( ServerHandle *handle, lua_State *L )
+{
+  Transport *tpt = &handle->atpt;
+  int op = transport_read_u8( tpt );
+  int *ref = op <= SUB_ON ? &handle->subs_ref : &handle->watches_ref;
+
+  if( *ref == LUA_NOREF )
+  {
+    lua_newtable( L );
+    *ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  }
+  lua_rawgeti( L, LUA_REGISTRYINDEX, *ref );
+  read_string( tpt, L, transport_read_u32( tpt ) );
+  if( op == SUB_OFF || op == WATCH_OFF )
+    lua_pushnil( L );
+  else
+    lua_pushnumber( L, op );
+  lua_rawset( L, -3 );
+  lua_pop( L, 1 );
+}
+
+// push an event: marker RPC_PUSH with a topic and a value, or RPC_NOTIFY
+// with a path and, unless value is 0, its new value. name and value are
+// stack indices.
+static void server_write_push( lua_State *L, ServerHandle *handle, int marker, int name, int value )
+{
+  Transport *tpt = &handle->atpt;
+  size_t len;
+  const char *s = lua_tolstring( L, name, &len );
+
+  transport_write_u8( tpt, marker );
+  transport_write_u32( tpt, ( u32 )len );
+  transport_write_string( tpt, s, ( int )len );
+  if( marker == RPC_NOTIFY )
+    transport_write_u8( tpt, value != 0 );
+  if( value )
+  {
+    lua_pushvalue( L, value );
+    write_variable( tpt, L, lua_gettop( L ) );
+    lua_pop( L, 1 );
+  }
+  tpt->stats.pushes++;
+}
+
+// push an event now or, while a command is being served, once its reply
+// is complete. as server_write_push, so a write may throw.
+static void server_push( lua_State *L, ServerHandle *handle, int marker, int name, int value )
+{
+  if( !handle->serving )
+  {
+    server_write_push( L, handle, marker, name, value );
+    return;
+  }
+  if( name < 0 )
+    name = lua_gettop( L ) + name + 1;
+  if( value < 0 )
+    value = lua_gettop( L ) + value + 1;
+  if( handle->pushes_ref == LUA_NOREF )
+  {
+    lua_newtable( L );
+    handle->pushes_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  }
+  lua_rawgeti( L, LUA_REGISTRYINDEX, handle->pushes_ref );
+  lua_createtable( L, 4, 0 );
+  lua_pushnumber( L, marker );
+  lua_rawseti( L, -2, 1 );
+  lua_pushvalue( L, name );
+  lua_rawseti( L, -2, 2 );
+  if( value )
+  {
+    lua_pushvalue( L, value );
+    lua_rawseti( L, -2, 3 );
+    lua_pushboolean( L, 1 );
+    lua_rawseti( L, -2, 4 );
+  }
+  lua_rawseti( L, -2, ( int )lua_objlen( L, -2 ) + 1 );
+  lua_pop( L, 1 );
+}
+
+// send the events queued while a command was being served, now that its
+// reply is complete
+static void server_flush_pushes( lua_State *L, ServerHandle *handle )
+{
+  int i, n, pushes = handle->pushes_ref;
+
+  if( pushes == LUA_NOREF )
+    return;
+  handle->pushes_ref = LUA_NOREF;
+  lua_rawgeti( L, LUA_REGISTRYINDEX, pushes );
+  luaL_unref( L, LUA_REGISTRYINDEX, pushes );
+  n = ( int )lua_objlen( L, -1 );
+  for( i = 1; i <= n; i ++ )
+  {
+    lua_rawgeti( L, -1, i );
+    lua_rawgeti( L, -1, 1 );
+    lua_rawgeti( L, -2, 2 );
+    lua_rawgeti( L, -3, 3 );
+    lua_rawgeti( L, -4, 4 );
+    server_write_push( L, handle, ( int )lua_tonumber( L, -4 ), lua_gettop( L ) - 2,
+                       lua_toboolean( L, -1 ) ? lua_gettop( L ) - 1 : 0 );
+    lua_pop( L, 5 );
+  }
+  lua_pop( L, 1 );
+}
+
+// push the value at a dotted path from the globals, or nil where part of
+// the path is missing or not a table
+static void push_path_value_or_nil( lua_State *L, const char *path, size_t len )
+{
+  const char *p = path, *end = path + len, *dot;
+
+  lua_pushvalue( L, LUA_GLOBALSINDEX );
+  while( p <= end )
+  {
+    if( !lua_istable( L, -1 ) )
+    {
+      lua_pop( L, 1 );
+      lua_pushnil( L );
+      return;
+    }
+    dot = ( const char * )memchr( p, '.', end - p );
+    if( !dot )
+      dot = end;
+    lua_pushlstring( L, p, dot - p );
+    lua_gettable( L, -2 );
+    lua_remove( L, -2 );
+    p = dot + 1;
+  }
+}
+
+// tell the connection's watches related to a changed path about it
+static void server_notify_watchers( lua_State *L, ServerHandle *handle, const char *path )
+{
+  size_t len = strlen( path );
+
+  if( handle->watches_ref == LUA_NOREF || !transport_is_open( &handle->atpt ) )
+    return;
+  lua_rawgeti( L, LUA_REGISTRYINDEX, handle->watches_ref );
+  for( lua_pushnil( L ); lua_next( L, -2 ); lua_pop( L, 1 ) )
+    if( path_related( path, len, lua_tostring( L, -2 ), lua_strlen( L, -2 ) ) )
+    {
+      if( lua_tonumber( L, -1 ) == WATCH_VALUE )
+      {
+        push_path_value_or_nil( L, lua_tostring( L, -2 ), lua_strlen( L, -2 ) );
+        server_push( L, handle, RPC_NOTIFY, -3, -1 );
+        lua_pop( L, 1 );
+      }
+      else
+        server_push( L, handle, RPC_NOTIFY, -2, 0 );
+    }
+  lua_pop( L, 1 );
+}
+
+static void read_cmd_stream( ServerHandle *handle, lua_State *L )
+{
+  u32 len, size;
+  char *funcname;
+  Transport *tpt = &handle->atpt;
+
+  // read variable name and chunk size
+  len = transport_read_u32( tpt ); // variable name string length
+  funcname = ( char * )alloca( len + 1 );
+  transport_read_string( tpt, funcname, len );
+  funcname[ len ] = 0;
+  size = transport_read_u32( tpt );
+
+  push_path_value( L, funcname );
+  if( size == 0 )
+    size = lua_type( L, -1 ) == LUA_TSTRING ? STREAM_CHUNK_BYTES : STREAM_CHUNK_ENTRIES;
+
+  server_streams_push( L, handle );
+  if( ++handle->stream_seq == 0 ) // 0 means no stream
+    handle->stream_seq = 1;
+  lua_pushnil( L );
+  lua_rawseti( L, -2, handle->stream_seq - MAX_STREAMS );
+
+  lua_createtable( L, 4, 0 );
+  lua_pushvalue( L, -3 );
+  lua_rawseti( L, -2, STREAM_VALUE );
+  lua_pushnumber( L, size );
+  lua_rawseti( L, -2, STREAM_SIZE );
+  lua_rawseti( L, -2, handle->stream_seq );
+
+  transport_write_u32( tpt, handle->stream_seq );
+
+  // empty the stack
+  lua_settop ( L, 0 );
+}
+
+// send the next chunk of a stream, preceded by 1, or just 0 at its end
+static void read_cmd_chunk( ServerHandle *handle, lua_State *L )
+{
+  u32 id, size, n = 0;
+  int stream, value, more = 0;
+  Transport *tpt = &handle->atpt;
+
+  id = transport_read_u32( tpt );
+  server_streams_push( L, handle );
+  lua_rawgeti( L, -1, id );
+  stream = lua_gettop( L );
+
+  if( lua_istable( L, stream ) )
+  {
+    lua_rawgeti( L, stream, STREAM_DONE );
+    more = !lua_toboolean( L, -1 );
+    lua_pop( L, 1 );
+  }
+
+  if( more )
+  {
+    lua_rawgeti( L, stream, STREAM_SIZE );
+    size = ( u32 )lua_tonumber( L, -1 );
+    lua_rawgeti( L, stream, STREAM_VALUE );
+    value = lua_gettop( L );
+    lua_rawgeti( L, stream, STREAM_POS );
+
+    switch( lua_type( L, value ) )
+    {
+      case LUA_TSTRING:
+      {
+        size_t slen;
+        const char *s = lua_tolstring( L, value, &slen );
+        u32 off = ( u32 )lua_tonumber( L, -1 );
+
+        more = off < slen;
+        if( more )
+        {
+          n = slen - off < size ? slen - off : size;
+          transport_write_u8( tpt, 1 );
+          transport_write_u8( tpt, RPC_STRING );
+          transport_write_u32( tpt, n );
+          transport_write_string( tpt, s + off, n );
+          lua_pushnumber( L, off + n );
+          lua_rawseti( L, stream, STREAM_POS );
+        }
+        break;
+      }
+
+      case LUA_TTABLE:
+        // a key that has since been removed can't be continued from
+        if( !lua_isnil( L, -1 ) )
+        {
+          lua_pushvalue( L, -1 );
+          lua_rawget( L, value );
+          more = !lua_isnil( L, -1 );
+          lua_pop( L, 1 );
+        }
+        if( more && lua_next( L, value ) )
+        {
+          transport_write_u8( tpt, 1 );
+          transport_write_u8( tpt, RPC_TABLE );
+          do
+          {
+            write_variable( tpt, L, lua_gettop( L ) - 1 );
+            write_variable( tpt, L, lua_gettop( L ) );
+            lua_pop( L, 1 );
+          } while( ++n < size && lua_next( L, value ) );
+          transport_write_u8( tpt, RPC_TABLE_END );
+
+          // lua_next leaves the last key only if entries remain
+          if( n == size )
+            lua_rawseti( L, stream, STREAM_POS );
+          else
+          {
+            lua_pushboolean( L, 1 );
+            lua_rawseti( L, stream, STREAM_DONE );
+          }
+        }
+        else
+          more = 0;
+        break;
+
+      default: // anything else is a single chunk
+        transport_write_u8( tpt, 1 );
+        write_variable( tpt, L, value );
+        lua_pushboolean( L, 1 );
+        lua_rawseti( L, stream, STREAM_DONE );
+        break;
+    }
+  }
+
+  if( !more )
+  {
+    transport_write_u8( tpt, 0 );
+    lua_pushnil( L );
+    lua_rawseti( L, stream - 1, id );
+  }
+
+  // empty the stack
+  lua_settop ( L, 0 );
+}
+
+
+static ServerHandle *rpc_listen_helper( lua_State *L )
+{
+  struct exception e;
+  ServerHandle *handle = 0;
+
+  Try
+  {
+    // make server handle
+    handle = server_handle_create( L );
+
+    // make listening transport
+    transport_open_listener( L, handle );
+  }
+  Catch( e )
+  {
+    if( handle )
+      server_handle_destroy( handle );
+
+    deal_with_error( L, 0, errorString( e.errnum ) );
+    return 0;
+  }
+  return handle;
+}
+
+
+// rpc_listen( transport_indentifier ) --> server_handle
+//    transport_identifier defines where to listen, identifier type is subject to transport implementation
+static int rpc_listen( lua_State *L )
+{
+  ServerHandle *handle;
+
+  handle = rpc_listen_helper( L );
+  if ( handle == 0 )
+    return luaL_error( L, "bad handle" );
+
+  return 1;
+}
+
+
+// rpc_peek( server_handle ) --> 0 or 1
+static int rpc_peek( lua_State *L )
+{
+  ServerHandle *handle;
+
+  check_num_args( L, 1 );
+  if ( !( lua_isuserdata( L, 1 ) && ismetatable_type( L, 1, "rpc.server_handle" ) ) )
+    return luaL_error( L, "arg must be server handle" );
+
+  handle = ( ServerHandle * )lua_touserdata( L, 1 );
+
+  // if accepting transport is open, see if there is any data to read
+  if ( transport_is_open( &handle->atpt ) )
+  {
+    if ( transport_readable( &handle->atpt ) )
+      lua_pushnumber( L, 1 );
+    else
+      lua_pushnil( L );
+
+    return 1;
+  }
+
+  // otherwise, see if there is a new connection on the listening transport
+  if ( transport_is_open( &handle->ltpt ) )
+  {
+    if ( transport_readable( &handle->ltpt ) )
+      lua_pushnumber ( L, 1 );
+    else
+      lua_pushnil( L );
+
+    return 1;
+  }
+
+  lua_pushnumber( L, 0 );
+  return 1;
+}
+
+
+static void rpc_dispatch_helper( lua_State *L, ServerHandle *handle )
+{
+  struct exception e;
+  volatile int cmd = -1; // read in the Try, traced in the Catch
+
+  Try
+  {
+    // if accepting transport is open, read function calls. a client
+    // silent for longer than the idle timeout is presumed dead.
+    if ( transport_is_open( &handle->atpt ) && handle->idle_timeout > 0 &&
+         handle->peeked < 0 &&
+         !transport_wait_readable( &handle->atpt, handle->idle_timeout ) )
+    {
+      stats_error( &handle->atpt, ERR_TIMEOUT );
+      transport_close( &handle->atpt );
+    }
+    else if ( transport_is_open( &handle->atpt ) )
+    {
+      Try
+      {
+        if( handle->peeked >= 0 )
+        {
+          cmd = handle->peeked;
+          handle->peeked = -1;
+        }
+        else
+          cmd = transport_read_u8( &handle->atpt );
+        if( cmd < STATS_COMMANDS )
+          handle->atpt.stats.commands[ cmd ]++;
+        RPC_PROBE2( command__start, cmd, handle->atpt.stats.bytes_in );
+        handle->serving = 1;
+
+        switch ( cmd )
+        {
+          case RPC_CMD_CALL:  // call function
+            transport_write_u8( &handle->atpt, RPC_READY );
+            read_cmd_call( handle, L, 0 );
+            break;
+          case RPC_CMD_GET: // get server-side variable for client
+            transport_write_u8( &handle->atpt, RPC_READY );
+            read_cmd_get( &handle->atpt, L );
+            break;
+          case RPC_CMD_CON: //  allow client to renegotiate active connection
+            server_negotiate( &handle->atpt );
+            break;
+          case RPC_CMD_NEWINDEX: // assign new variable on server
+            transport_write_u8( &handle->atpt, RPC_READY );
+            read_cmd_newindex( handle, L );
+            break;
+          case RPC_CMD_GETV: // get server-side variable if changed
+            transport_write_u8( &handle->atpt, RPC_READY );
+            read_cmd_getv( &handle->atpt, L );
+            break;
+          case RPC_CMD_INDEX: // index server-side table with any key
+            transport_write_u8( &handle->atpt, RPC_READY );
+            read_cmd_index( &handle->atpt, L );
+            break;
+          case RPC_CMD_NEXT: // page through server-side table
+            transport_write_u8( &handle->atpt, RPC_READY );
+            read_cmd_next( &handle->atpt, L );
+            break;
+          case RPC_CMD_LEN: // length of server-side table or string
+            transport_write_u8( &handle->atpt, RPC_READY );
+            read_cmd_len( &handle->atpt, L );
+            break;
+          case RPC_CMD_STREAM: // open stream of server-side variable
+            transport_write_u8( &handle->atpt, RPC_READY );
+            read_cmd_stream( handle, L );
+            break;
+          case RPC_CMD_CHUNK: // next chunk of an open stream
+            transport_write_u8( &handle->atpt, RPC_READY );
+            read_cmd_chunk( handle, L );
+            break;
+          case RPC_CMD_DCALL: // call function with a deadline
+            transport_write_u8( &handle->atpt, RPC_READY );
+            read_cmd_call( handle, L, 1 );
+            break;
+          case RPC_CMD_CANCEL: // cancel a call that has already finished
+            transport_read_u32( &handle->atpt );
+            break;
+          case RPC_CMD_PING: // heartbeat
+            transport_write_u8( &handle->atpt, RPC_READY );
+            break;
+          case RPC_CMD_SUBSCRIBE: // start or stop pushing a topic's events
+            transport_write_u8( &handle->atpt, RPC_READY );
+            read_cmd_subscribe( handle, L );
+            break;
+          default: // complain and throw exception if unknown command
+            transport_write_u8(&handle->atpt, RPC_UNSUPPORTED_CMD );
+            e.type = nonfatal;
+            e.errnum = ERR_COMMAND;
+            Throw( e );
+        }
+
+        handle->link_errs = 0;
+        RPC_PROBE4( command__end, cmd, handle->atpt.stats.bytes_in,
+                    handle->atpt.stats.bytes_out, 0 );
+      }
+      Catch( e )
+      {
+        RPC_PROBE4( command__end, cmd, handle->atpt.stats.bytes_in,
+                    handle->atpt.stats.bytes_out, e.errnum );
+        stats_error( &handle->atpt, e.errnum );
+        switch( e.type )
+        {
+          case fatal: // shutdown will initiate after throw
+            Throw( e );
+
+          case nonfatal:
+            handle->atpt.stats.link_errs++;
+            handle->link_errs++;
+            if ( handle->link_errs > MAX_LINK_ERRS )
+            {
+              handle->link_errs = 0;
+              Throw( e ); // remote connection will be closed
+            }
+            break;
+
+          default:
+            Throw( e );
+        }
+      }
+      handle->serving = 0;
+      if( transport_is_open( &handle->atpt ) )
+        server_flush_pushes( L, handle );
+    }
+    else
+    {
+      // if accepting transport is not open, accept a new connection from the
+      // listening transport
+      transport_accept( &handle->ltpt, &handle->atpt );
+      server_streams_reset( L, handle );
+      server_push_reset( L, handle );
+      handle->peeked = -1;
+
+      switch ( transport_read_u8( &handle->atpt ) )
+      {
+        case RPC_CMD_CON:
+          server_negotiate( &handle->atpt );
+          handle->atpt.stats.connects++;
+          break;
+        default: // connection must be established to issue any other commands
+          e.type = nonfatal;
+          e.errnum = ERR_COMMAND;
+          Throw( e ); // remote connection will be closed
+      }
+    }
+  }
+  Catch( e )
+  {
+    switch( e.type )
+    {
+      case fatal:
+        server_handle_shutdown( handle );
+        deal_with_error( L, 0, errorString( e.errnum ) );
+        break;
+
+      case nonfatal:
+        transport_close( &handle->atpt );
+        break;
+
+      default:
+        Throw( e );
+    }
+  }
+}
+
+
+// rpc_dispatch( server_handle )
+static int rpc_dispatch( lua_State *L )
+{
+  ServerHandle *handle;
+  check_num_args( L, 1 );
+
+  handle = ( ServerHandle * )luaL_checkudata(L, 1, "rpc.server_handle");
+  luaL_argcheck(L, handle, 1, "server handle expected");
+
+  handle = ( ServerHandle * )lua_touserdata( L, 1 );
+
+  rpc_dispatch_helper( L, handle );
+  return 0;
+}
+
+
+// rpc_server( transport_identifier )
+static int rpc_server( lua_State *L )
+{
+  int shref;
+  ServerHandle *handle = rpc_listen_helper( L );
+
+  // Anchor handle in the registry
+  //   This is needed because garbage collection can steal our handle,
+  //   which isn't otherwise referenced
+  //
+  //   @@@ this should be replaced when we create a system for multiple
+  //   @@@ connections. such a mechanism would likely likely create a
+  //   @@@ table for multiple connections that we could service in an event loop
+
+  shref = luaL_ref( L, LUA_REGISTRYINDEX );
+  lua_rawgeti(L, LUA_REGISTRYINDEX, shref );
+
+  while ( transport_is_open( &handle->ltpt ) )
+    rpc_dispatch_helper( L, handle );
+
+  luaL_unref( L, LUA_REGISTRYINDEX, shref );
+  server_handle_destroy( handle );
+  return 0;
+}
+
+// **************************************************************************
+// blobs
+//
+//  a blob is a range of a file that is sent like a string, but whose bytes go
+//  from the file to the transport without being read into a Lua string (with
+//  sendfile where the link supports it). the receiver gets a string, unless
+//  it has set a blob sink, in which case the bytes are written to a file and
+//  it gets a blob for that file, which can be forwarded the same way.
+
+static Blob *blob_create( lua_State *L, const char *path, FILE *f, u32 offset, u32 length )
+{
+  size_t len = strlen( path );
+  Blob *b = ( Blob * )lua_newuserdata( L, offsetof( Blob, path ) + len + 1 );
+  luaL_getmetatable( L, "rpc.blob" );
+  lua_setmetatable( L, -2 );
+
+  b->file = f;
+  b->offset = offset;
+  b->length = length;
+  memcpy( b->path, path, len + 1 );
+  return b;
+}
+
+// rpc_file_blob( path [, offset [, length ] ] ) --> blob
+//    length defaults to the rest of the file.
+static int rpc_file_blob( lua_State *L )
+{
+  const char *path = luaL_checkstring( L, 1 );
+  lua_Number offset = luaL_optnumber( L, 2, 0 );
+  lua_Number length;
+  long size;
+  FILE *f;
+
+  f = fopen( path, "rb" );
+  if( f == NULL )
+    return luaL_error( L, "cannot open %s: %s", path, strerror( errno ) );
+  fseek( f, 0, SEEK_END );
+  size = ftell( f );
+
+  length = luaL_optnumber( L, 3, size - offset );
+  if( offset < 0 || length < 0 || offset + length > size || offset + length > 0xFFFFFFFFu )
+  {
+    fclose( f );
+    return luaL_error( L, "blob range outside of %s", path );
+  }
+
+  blob_create( L, path, f, ( u32 )offset, ( u32 )length );
+  return 1;
+}
+
+static int blob_close( lua_State *L )
+{
+  Blob *b = ( Blob * )luaL_checkudata( L, 1, "rpc.blob" );
+
+  if( b->file )
+    fclose( b->file );
+  b->file = NULL;
+  return 0;
+}
+
+static int blob_path( lua_State *L )
+{
+  Blob *b = ( Blob * )luaL_checkudata( L, 1, "rpc.blob" );
+
+  lua_pushstring( L, b->path );
+  return 1;
+}
+
+static int blob_len( lua_State *L )
+{
+  Blob *b = ( Blob * )luaL_checkudata( L, 1, "rpc.blob" );
+
+  lua_pushnumber( L, b->length );
+  return 1;
+}
+
+// blob:read() --> contents as a string
+static int blob_read( lua_State *L )
+{
+  Blob *b = ( Blob * )luaL_checkudata( L, 1, "rpc.blob" );
+  luaL_Buffer buf;
+  u32 left = b->length;
+  size_t n;
+
+  if( b->file == NULL )
+    return luaL_error( L, "attempt to read a closed blob" );
+  fseek( b->file, b->offset, SEEK_SET );
+
+  luaL_buffinit( L, &buf );
+  while( left > 0 )
+  {
+    n = fread( luaL_prepbuffer( &buf ), 1, left < LUAL_BUFFERSIZE ? left : LUAL_BUFFERSIZE, b->file );
+    if( n == 0 )
+      break;
+    luaL_addsize( &buf, n );
+    left -= n;
+  }
+  luaL_pushresult( &buf );
+  return 1;
+}
+
+// rpc_blob_sink( handle, directory )
+//    write blobs received on a client or server handle to new files in
+//    directory, receiving them as blobs rather than strings. a nil directory
+//    goes back to strings.
+static int rpc_blob_sink( lua_State *L )
+{
+  Transport *tpt;
+
+  if( lua_isuserdata( L, 1 ) && ismetatable_type( L, 1, "rpc.handle" ) )
+    tpt = &( ( Handle * )lua_touserdata( L, 1 ) )->tpt;
+  else if( lua_isuserdata( L, 1 ) && ismetatable_type( L, 1, "rpc.server_handle" ) )
+    tpt = &( ( ServerHandle * )lua_touserdata( L, 1 ) )->atpt;
+  else
+    return luaL_error( L, "first arg must be client or server handle" );
+
+  luaL_unref( L, LUA_REGISTRYINDEX, tpt->blob_sink );
+  tpt->blob_sink = LUA_NOREF;
+  if( !lua_isnoneornil( L, 2 ) )
+  {
+    luaL_checkstring( L, 2 );
+    lua_pushvalue( L, 2 );
+    tpt->blob_sink = luaL_ref( L, LUA_REGISTRYINDEX );
+  }
+  return 0;
+}
+
+// rpc_stats( handle | server_handle ) --> table
+//    the counters kept by a connection. a server handle's counters cover
+//    every connection it has accepted.
+static int rpc_stats( lua_State *L )
+{
+  static const char *const commands[] =
+  {
+    NULL, "calls", "gets", NULL, "newindexes", "revalidations",
+    "indexes", "nexts", "lens", "streams", "chunks", "deadline_calls",
+    "cancels", "pings", "subscribes"
+  };
+  static const char *const errors[ STAT_ERR_CLASSES ] =
+  {
+    "eof", "closed", "protocol", "nodata", "command", "header", "timeout",
+    "system"
+  };
+  Stats *st;
+  int i;
+
+  if( lua_isuserdata( L, 1 ) && ismetatable_type( L, 1, "rpc.handle" ) )
+    st = &( ( Handle * )lua_touserdata( L, 1 ) )->tpt.stats;
+  else if( lua_isuserdata( L, 1 ) && ismetatable_type( L, 1, "rpc.server_handle" ) )
+    st = &( ( ServerHandle * )lua_touserdata( L, 1 ) )->atpt.stats;
+  else
+    return luaL_error( L, "arg must be client or server handle" );
+
+  lua_newtable( L );
+  for( i = 0; i < ( int )( sizeof( commands ) / sizeof( commands[ 0 ] ) ); i ++ )
+    if( commands[ i ] )
+    {
+      lua_pushnumber( L, ( lua_Number )st->commands[ i ] );
+      lua_setfield( L, -2, commands[ i ] );
+    }
+
+  lua_pushnumber( L, ( lua_Number )st->bytes_in );
+  lua_setfield( L, -2, "bytes_in" );
+  lua_pushnumber( L, ( lua_Number )st->bytes_out );
+  lua_setfield( L, -2, "bytes_out" );
+  lua_pushnumber( L, ( lua_Number )( st->reads + st->writes ) );
+  lua_setfield( L, -2, "syscalls" );
+  lua_pushnumber( L, ( lua_Number )st->link_errs );
+  lua_setfield( L, -2, "link_errs" );
+  lua_pushnumber( L, ( lua_Number )st->connects );
+  lua_setfield( L, -2, "connects" );
+  lua_pushnumber( L, ( lua_Number )st->reconnects );
+  lua_setfield( L, -2, "reconnects" );
+  lua_pushnumber( L, ( lua_Number )st->expired );
+  lua_setfield( L, -2, "expired" );
+  lua_pushnumber( L, ( lua_Number )st->cancelled );
+  lua_setfield( L, -2, "cancelled" );
+  lua_pushnumber( L, ( lua_Number )st->pushes );
+  lua_setfield( L, -2, "pushes" );
+
+  lua_newtable( L );
+  for( i = 0; i < STAT_ERR_CLASSES; i ++ )
+  {
+    lua_pushnumber( L, ( lua_Number )st->errors[ i ] );
+    lua_setfield( L, -2, errors[ i ] );
+  }
+  lua_setfield( L, -2, "errors" );
+  return 1;
+}
+
+// push a table describing one phase of a function's calls
+static void fstats_push_phase( lua_State *L, FuncStats *fs, int phase )
+{
+  static const double percentiles[] = { 0.5, 0.9, 0.99, 0.999 };
+  static const char *const names[] = { "p50_us", "p90_us", "p99_us", "p999_us" };
+  u32 seen = 0;
+  int b, p = 0;
+
+  lua_newtable( L );
+  lua_pushnumber( L, fs->total[ phase ] * 1e6 );
+  lua_setfield( L, -2, "total_us" );
+  lua_pushnumber( L, fs->max[ phase ] * 1e6 );
+  lua_setfield( L, -2, "max_us" );
+
+  // histogram, keyed by the smallest time in each bucket
+  lua_newtable( L );
+  for( b = 0; b < FSTAT_BUCKETS; b ++ )
+  {
+    u32 n = fs->buckets[ phase ][ b ];
+    if( n == 0 )
+      continue;
+    lua_pushnumber( L, n );
+    lua_rawseti( L, -2, ( int )fstats_value( b ) );
+    for( seen += n; p < 4 && seen >= percentiles[ p ] * fs->calls; p ++ )
+    {
+      lua_pushnumber( L, fstats_value( b ) );
+      lua_setfield( L, -3, names[ p ] );
+    }
+  }
+  lua_setfield( L, -2, "histogram" );
+}
+
+// rpc_function_stats( server_handle [, reset ] ) --> table
+//    latency of the calls served, by function name, split into decoding the
+//    arguments, running the function and encoding the results. a true reset
+//    starts the counts again after reading them.
+static int rpc_function_stats( lua_State *L )
+{
+  static const char *const phases[ FSTAT_PHASES ] = { "decode", "call", "encode" };
+  ServerHandle *handle = ( ServerHandle * )luaL_checkudata( L, 1, "rpc.server_handle" );
+  int i;
+
+  lua_newtable( L );
+  if( handle->fstats == LUA_NOREF )
+    return 1;
+
+  lua_rawgeti( L, LUA_REGISTRYINDEX, handle->fstats );
+  lua_pushnil( L );
+  while( lua_next( L, -2 ) )
+  {
+    FuncStats *fs = ( FuncStats * )lua_touserdata( L, -1 );
+    lua_pop( L, 1 );
+    lua_pushvalue( L, -1 );
+    lua_newtable( L );
+    lua_pushnumber( L, fs->calls );
+    lua_setfield( L, -2, "calls" );
+    lua_pushnumber( L, fs->errors );
+    lua_setfield( L, -2, "errors" );
+    for( i = 0; i < FSTAT_PHASES; i ++ )
+    {
+      fstats_push_phase( L, fs, i );
+      lua_setfield( L, -2, phases[ i ] );
     }
-    else
+    lua_rawset( L, -5 );
+  }
+  lua_pop( L, 1 );
+
+  if( lua_toboolean( L, 2 ) )
+  {
+    luaL_unref( L, LUA_REGISTRYINDEX, handle->fstats );
+    handle->fstats = LUA_NOREF;
+  }
+  return 1;
+}
+
+// rpc_slow_log( server_handle, threshold [, entries ] )
+//    keeps the last entries (SLOW_LOG_ENTRIES by default) calls that took at
+//    least threshold seconds, for rpc_slow_calls. a nil threshold turns the
+//    log off and drops what it holds.
+static int rpc_slow_log( lua_State *L )
+{
+  ServerHandle *handle = ( ServerHandle * )luaL_checkudata( L, 1, "rpc.server_handle" );
+  int entries = luaL_optint( L, 3, SLOW_LOG_ENTRIES );
+  double threshold;
+
+  luaL_unref( L, LUA_REGISTRYINDEX, handle->slow_ref );
+  handle->slow_ref = LUA_NOREF;
+  handle->slow = NULL;
+  if( lua_isnoneornil( L, 2 ) )
+    return 0;
+
+  threshold = luaL_checknumber( L, 2 );
+  luaL_argcheck( L, entries > 0, 3, "must keep at least one call" );
+  handle->slow = ( SlowLog * )lua_newuserdata( L, sizeof( SlowLog ) + entries * sizeof( SlowCall ) );
+  handle->slow->threshold = threshold;
+  handle->slow->size = entries;
+  handle->slow->count = 0;
+  handle->slow_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  return 0;
+}
+
+// rpc_slow_calls( server_handle [, filename ] ) --> table or count
+//    the calls in the slow call log, oldest first. with a filename they are
+//    appended to that file, one per line, and the number written is returned.
+static int rpc_slow_calls( lua_State *L )
+{
+  static const char *const phases[ FSTAT_PHASES ] = { "decode_us", "call_us", "encode_us" };
+  ServerHandle *handle = ( ServerHandle * )luaL_checkudata( L, 1, "rpc.server_handle" );
+  const char *filename = luaL_optstring( L, 2, NULL );
+  SlowLog *log = handle->slow;
+  u32 i, first, n;
+  FILE *f = NULL;
+  int p;
+
+  n = log == NULL ? 0 : log->count < log->size ? log->count : log->size;
+  first = log == NULL ? 0 : log->count - n;
+
+  if( filename )
+  {
+    if( ( f = fopen( filename, "a" ) ) == NULL )
+      return luaL_error( L, "cannot open %s: %s", filename, strerror( errno ) );
+    for( i = 0; i < n; i ++ )
     {
-      // pass the return values back to the caller
-      transport_write_u8( tpt, 0 );
-      nret = lua_gettop( L ) - stackpos;
-      transport_write_u32( tpt, nret );
-      for ( i = 0; i < nret; i ++ )
-        write_variable( tpt, L, stackpos + 1 + i );
+      SlowCall *c = &log->calls[ ( first + i ) % log->size ];
+      fprintf( f, "%.0f %s %s request=%lu reply=%lu", c->at, c->peer, c->path,
+               ( unsigned long )c->request_bytes, ( unsigned long )c->reply_bytes );
+      for( p = 0; p < FSTAT_PHASES; p ++ )
+        fprintf( f, " %s=%.0f", phases[ p ], c->phase[ p ] * 1e6 );
+      fprintf( f, "\n" );
     }
+    fclose( f );
+    lua_pushnumber( L, n );
+    return 1;
   }
-  else
+
+  lua_createtable( L, n, 0 );
+  for( i = 0; i < n; i ++ )
   {
-    // bad index or function call
-    const char *msg;
-    if ( lua_isnil( L, -1 ) )
-      msg = "undefined: ";
-    else if ( lua_istable( L, -1 ) )
-      msg = "attempted to call table";
-    else
-      msg = "not table/function: ";
-    if( token == NULL ) // should occur if "function" was actually a table
-      token = "";
-    int errlen = ( int )strlen( msg ) + strlen( token );
-    transport_write_u8( tpt, 1 );
-    transport_write_u32( tpt, LUA_ERRRUN );
-    transport_write_u32( tpt, errlen );
-    transport_write_string( tpt, msg, ( int )strlen( msg ) );
-    transport_write_string( tpt, token, strlen( token ) );
+    SlowCall *c = &log->calls[ ( first + i ) % log->size ];
+    lua_newtable( L );
+    lua_pushnumber( L, c->at );
+    lua_setfield( L, -2, "at" );
+    lua_pushstring( L, c->path );
+    lua_setfield( L, -2, "path" );
+    lua_pushstring( L, c->peer );
+    lua_setfield( L, -2, "peer" );
+    lua_pushnumber( L, c->request_bytes );
+    lua_setfield( L, -2, "request_bytes" );
+    lua_pushnumber( L, c->reply_bytes );
+    lua_setfield( L, -2, "reply_bytes" );
+    for( p = 0; p < FSTAT_PHASES; p ++ )
+    {
+      lua_pushnumber( L, c->phase[ p ] * 1e6 );
+      lua_setfield( L, -2, phases[ p ] );
+    }
+    lua_rawseti( L, -2, i + 1 );
   }
-  // empty the stack
-  lua_settop ( L, 0 );
+  return 1;
 }
 
+// rpc_clock() --> seconds
+//    a monotonic clock for timing calls
+static int rpc_clock_seconds( lua_State *L )
+{
+  lua_pushnumber( L, rpc_clock() );
+  return 1;
+}
 
-static void read_cmd_get( Transport *tpt, lua_State *L )
+// rpc_sleep( seconds )
+//    waits without spinning, for pacing calls
+static int rpc_sleep( lua_State *L )
 {
-  u32 len;
-  char *funcname;
-  char *token = NULL;
+  double s = luaL_checknumber( L, 1 );
 
-  // read function name
-  len = transport_read_u32( tpt ); // function name string length
-  funcname = ( char * )alloca( len + 1 );
-  transport_read_string( tpt, funcname, len );
-  funcname[ len ] = 0;
+  if( s > 0 )
+  {
+#if defined( WIN32_BUILD )
+    Sleep( ( DWORD )( s * 1000 ) );
+#else
+    struct timespec ts;
+    ts.tv_sec = ( time_t )s;
+    ts.tv_nsec = ( long )( ( s - ts.tv_sec ) * 1e9 );
+    nanosleep( &ts, NULL );
+#endif
+  }
+  return 0;
+}
 
-  // get function
-  // @@@ perhaps handle more like variables instead of using a long string?
-  // @@@ also strtok is not thread safe
-  token = strtok( funcname, "." );
-  lua_getglobal( L, token );
-  token = strtok( NULL, "." );
-  while( token != NULL )
+// **************************************************************************
+// encoding values without a connection
+//   encoded values start with the same 8 byte header a client sends when it
+//   connects, describing the number format that follows.
+
+static int membuf_gc( lua_State *L )
+{
+  MemBuf *mb = ( MemBuf * )lua_touserdata( L, 1 );
+  free( mb->data );
+  mb->data = NULL;
+  mb->size = mb->len = mb->pos = 0;
+  return 0;
+}
+
+// set the number format of a memory transport, returning 0 if the codecs
+// can't produce it
+static int membuf_format( Transport *tpt, int little, int lnum_bytes, int intnum )
+{
+  int x = 1;
+
+  tpt->loc_little = ( char )*( char * )&x;
+  tpt->loc_intnum = ( char )( ( ( lua_Number )0.5 ) == 0 );
+  tpt->net_little = little ? 1 : 0;
+  tpt->net_intnum = intnum || tpt->loc_intnum;
+  tpt->lnum_bytes = lnum_bytes;
+  codec_select( tpt );
+  if( tpt->net_intnum )
+    return lnum_bytes == 1 || lnum_bytes == 2 || lnum_bytes == 4 || lnum_bytes == 8;
+  return lnum_bytes == sizeof( lua_Number );
+}
+
+// rpc_encode( value [, opts ] )
+//    serializes a value into a string. opts may set the number format with
+//    little (boolean), number_bytes and integer (boolean); they default to
+//    the local format.
+static int rpc_encode( lua_State *L )
+{
+  struct exception e;
+  Transport tpt;
+  MemBuf *mb;
+  char header[ 8 ];
+  int x = 1;
+  int little = *( char * )&x, lnum_bytes = sizeof( lua_Number ), intnum = 0;
+
+  luaL_checkany( L, 1 );
+  if( lua_istable( L, 2 ) )
   {
-    lua_getfield( L, -1, token );
-    lua_remove( L, -2 );
-    token = strtok( NULL, "." );
+    lua_getfield( L, 2, "little" );
+    if( !lua_isnil( L, -1 ) )
+      little = lua_toboolean( L, -1 );
+    lua_getfield( L, 2, "number_bytes" );
+    if( !lua_isnil( L, -1 ) )
+      lnum_bytes = luaL_checkint( L, -1 );
+    lua_getfield( L, 2, "integer" );
+    intnum = lua_toboolean( L, -1 );
+    lua_pop( L, 3 );
+  }
+  else if( !lua_isnoneornil( L, 2 ) )
+    return luaL_error( L, "opts must be a table" );
+  lua_settop( L, 1 );
+
+  transport_init( &tpt );
+  if( !membuf_format( &tpt, little, lnum_bytes, intnum ) )
+    return luaL_error( L, "unsupported number format" );
+
+  mb = ( MemBuf * )lua_newuserdata( L, sizeof( MemBuf ) );
+  mb->data = NULL;
+  mb->size = mb->len = mb->pos = 0;
+  luaL_getmetatable( L, "rpc.membuf" );
+  lua_setmetatable( L, -2 );
+  tpt.mem = mb;
+
+  header[0] = 'L';
+  header[1] = 'R';
+  header[2] = 'P';
+  header[3] = 'C';
+  header[4] = RPC_PROTOCOL_VERSION;
+  header[5] = tpt.net_little;
+  header[6] = tpt.lnum_bytes;
+  header[7] = tpt.net_intnum;
+
+  Try
+  {
+    transport_write_string( &tpt, header, sizeof( header ) );
+    write_variable( &tpt, L, 1 );
+  }
+  Catch( e )
+  {
+    return luaL_error( L, "encode failed: %s", errorString( e.errnum ) );
   }
 
-  // return top value on stack
-  write_variable( tpt, L, lua_gettop( L ) );
+  lua_pushlstring( L, ( const char * )mb->data, mb->len );
+  return 1;
+}
 
-  // empty the stack
-  lua_settop ( L, 0 );
+// rpc_decode( string )
+//    returns the value serialized in a string by rpc_encode
+static int rpc_decode( lua_State *L )
+{
+  struct exception e;
+  Transport tpt;
+  MemBuf mb;
+  char header[ 8 ];
+
+  mb.data = ( u8 * )luaL_checklstring( L, 1, &mb.len ); // only read from
+  mb.size = mb.pos = 0;
+  transport_init( &tpt );
+  tpt.mem = &mb;
+
+  Try
+  {
+    transport_read_string( &tpt, header, sizeof( header ) );
+    if( header[0] != 'L' ||
+        header[1] != 'R' ||
+        header[2] != 'P' ||
+        header[3] != 'C' ||
+        header[4] != RPC_PROTOCOL_VERSION ||
+        !membuf_format( &tpt, header[5], header[6], header[7] ) )
+    {
+      e.errnum = ERR_HEADER;
+      e.type = fatal;
+      Throw( e );
+    }
+    if( !read_variable( &tpt, L ) || mb.pos != mb.len )
+    {
+      e.errnum = ERR_PROTOCOL;
+      e.type = fatal;
+      Throw( e );
+    }
+  }
+  Catch( e )
+  {
+    return luaL_error( L, "decode failed: %s", errorString( e.errnum ) );
+  }
+  return 1;
 }
 
+// **************************************************************************
+// client side caching
+
+// rpc_cache( handle, ttl [, mode ] )
+//    caches the results of get() on a client handle for ttl seconds. with
+//    mode "validate", stale entries are revalidated with a cheap
+//    if-not-modified request instead of being transferred again. a nil ttl
+//    turns caching off. cached tables are shared, so treat them as read-only.
+static int rpc_cache( lua_State *L )
+{
+  static const char *const modes[] = { "ttl", "validate", NULL };
+  Handle *handle = ( Handle * )luaL_checkudata( L, 1, "rpc.handle" );
+
+  luaL_unref( L, LUA_REGISTRYINDEX, handle->cache_ref );
+  handle->cache_ref = LUA_NOREF;
+
+  if( lua_isnoneornil( L, 2 ) )
+    return 0;
+
+  handle->cache_ttl = luaL_checknumber( L, 2 );
+  handle->cache_validate = luaL_checkoption( L, 3, "ttl", modes );
+  lua_newtable( L );
+  handle->cache_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  return 0;
+}
 
-static void read_cmd_newindex( Transport *tpt, lua_State *L )
+// rpc_deadline( handle, ms )
+//    gives every call made through the handle ms milliseconds to complete,
+//    including time spent waiting on the server. 0 or nil turns it off.
+//    with_deadline() sets a deadline for one helper instead.
+static int rpc_deadline( lua_State *L )
 {
-  u32 len;
-  char *funcname;
-  char *token = NULL;
+  Handle *handle = ( Handle * )luaL_checkudata( L, 1, "rpc.handle" );
 
-  // read function name
-  len = transport_read_u32( tpt ); // function name string length
-  funcname = ( char * )alloca( len + 1 );
-  transport_read_string( tpt, funcname, len );
-  funcname[ len ] = 0;
+  handle->deadline_ms = ( u32 )luaL_optnumber( L, 2, 0 );
+  return 0;
+}
 
-  // get function
-  // @@@ perhaps handle more like variables instead of using a long string?
-  // @@@ also strtok is not thread safe
-  if( strlen( funcname ) > 0 )
+// rpc_remaining() --> seconds | nil
+//    called from a function being served, the time left before its caller
+//    gives up on it. nil if the call has no deadline.
+static int rpc_remaining( lua_State *L )
+{
+  if( !call_server || call_server->call_deadline == 0 )
+    return 0;
+  lua_pushnumber( L, call_server->call_deadline - rpc_clock() );
+  return 1;
+}
+
+// rpc_cancelled() --> boolean
+//    called from a function being served, whether its caller has cancelled
+//    it. long running functions can check this now and then and give up.
+static int rpc_cancelled( lua_State *L )
+{
+  struct exception e;
+  int cancelled = 0;
+
+  if( call_server && call_server->call_tagged )
   {
-    token = strtok( funcname, "." );
-    lua_getglobal( L, token );
-    token = strtok( NULL, "." );
-    while( token != NULL )
+    Try
     {
-      lua_getfield( L, -1, token );
-      lua_remove( L, -2 );
-      token = strtok( NULL, "." );
+      cancelled = server_check_cancel( call_server, call_server->call_id );
+    }
+    Catch( e )
+    {
+      stats_error( &call_server->atpt, e.errnum );
+      cancelled = 1; // the caller is gone
     }
-    read_variable( tpt, L ); // key
-    read_variable( tpt, L ); // value
-    lua_settable( L, -3 ); // set key to value on indexed table
   }
-  else
+  lua_pushboolean( L, cancelled );
+  return 1;
+}
+
+// rpc_reconnect( handle, on [, max_delay ] )
+//    with on true, a handle whose connection closed reopens it on the next
+//    command, so its helpers keep working. failed attempts are retried no
+//    sooner than 0.1s, 0.2s, 0.4s ... later, up to max_delay seconds.
+static int rpc_reconnect( lua_State *L )
+{
+  Handle *handle = ( Handle * )luaL_checkudata( L, 1, "rpc.handle" );
+
+  handle->reconnect = lua_toboolean( L, 2 );
+  handle->reconnect_max = luaL_optnumber( L, 3, RECONNECT_MAX_DELAY );
+  handle->reconnect_delay = RECONNECT_MIN_DELAY;
+  handle->reconnect_at = 0;
+  return 0;
+}
+
+// rpc_ping( handle [, timeout ] ) --> seconds
+//    round trip time to the server. if it doesn't answer within timeout
+//    seconds the connection is closed.
+static int rpc_ping( lua_State *L )
+{
+  struct exception e;
+  int freturn = 0;
+  Handle *handle = ( Handle * )luaL_checkudata( L, 1, "rpc.handle" );
+  double timeout = luaL_optnumber( L, 2, handle->tpt.heartbeat_timeout );
+
+  Try
   {
-    read_variable( tpt, L ); // key
-    read_variable( tpt, L ); // value
-    lua_setglobal( L, lua_tostring( L, -2 ) );
+    helper_prepare( L, handle );
+    lua_pushnumber( L, helper_ping( L, handle, timeout ) );
+    freturn = 1;
   }
-  // Write out 0 to indicate no error and that we're done
-  transport_write_u8( tpt, 0 );
+  Catch( e )
+  {
+    freturn = generic_catch_handler( L, handle, e );
+  }
+  return freturn;
+}
 
-  // if ( error_code ) // Add some error handling later
-  // {
-  //   size_t len;
-  //   const char *errmsg;
-  //   errmsg = lua_tolstring (L, -1, &len);
-  //   transport_write_u8( tpt, 1 );
-  //   transport_write_u32( tpt, error_code );
-  //   transport_write_u32( tpt, len );
-  //   transport_write_string( tpt, errmsg, len );
-  // }
+// rpc_heartbeat( handle, interval [, timeout ] )
+//    pings the server before any command sent after interval idle seconds,
+//    so a dead server is found within timeout seconds instead of the
+//    command blocking until the system gives up. nil or 0 turns it off.
+static int rpc_heartbeat( lua_State *L )
+{
+  Handle *handle = ( Handle * )luaL_checkudata( L, 1, "rpc.handle" );
 
-  // empty the stack
-  lua_settop ( L, 0 );
+  handle->tpt.heartbeat = luaL_optnumber( L, 2, 0 );
+  handle->tpt.heartbeat_timeout = luaL_optnumber( L, 3, HEARTBEAT_TIMEOUT );
+  return 0;
 }
 
+// rpc_keepalive( handle | server_handle, idle [, interval [, count ] ] )
+//    has the system probe an idle TCP connection, dropping it once count
+//    probes interval seconds apart go unanswered. a server handle passes
+//    this on to the connections it accepts. idle 0 or nil turns it off.
+static int rpc_keepalive( lua_State *L )
+{
+  u32 idle = ( u32 )luaL_optnumber( L, 2, 0 );
+  u32 interval = ( u32 )luaL_optnumber( L, 3, 1 );
+  u32 count = ( u32 )luaL_optnumber( L, 4, 3 );
 
-static ServerHandle *rpc_listen_helper( lua_State *L )
+  if( lua_isuserdata( L, 1 ) && ismetatable_type( L, 1, "rpc.handle" ) )
+  {
+    Handle *handle = ( Handle * )lua_touserdata( L, 1 );
+    handle->keepalive[ 0 ] = idle;
+    handle->keepalive[ 1 ] = interval;
+    handle->keepalive[ 2 ] = count;
+    transport_set_keepalive( &handle->tpt, idle, interval, count );
+  }
+  else if( lua_isuserdata( L, 1 ) && ismetatable_type( L, 1, "rpc.server_handle" ) )
+  {
+    ServerHandle *sh = ( ServerHandle * )lua_touserdata( L, 1 );
+    transport_set_keepalive( &sh->ltpt, idle, interval, count );
+    transport_set_keepalive( &sh->atpt, idle, interval, count );
+  }
+  else
+    return luaL_error( L, "arg must be client or server handle" );
+  return 0;
+}
+
+// rpc_idle_timeout( server_handle, seconds )
+//    closes a client connection that sends nothing for seconds, so the
+//    server moves on to the next client. nil or 0 waits forever.
+static int rpc_idle_timeout( lua_State *L )
+{
+  ServerHandle *handle = ( ServerHandle * )luaL_checkudata( L, 1, "rpc.server_handle" );
+
+  handle->idle_timeout = luaL_optnumber( L, 2, 0 );
+  return 0;
+}
+
+// rpc_timeout( handle, ms )
+//    makes reads and writes on the connection fail after blocking for ms
+//    milliseconds, closing it. 0 or nil waits forever.
+static int rpc_timeout( lua_State *L )
+{
+  Handle *handle = ( Handle * )luaL_checkudata( L, 1, "rpc.handle" );
+
+  handle->timeout_ms = ( u32 )luaL_optnumber( L, 2, 0 );
+  transport_set_timeout( &handle->tpt, handle->timeout_ms );
+  return 0;
+}
+
+// **************************************************************************
+// publish / subscribe
+//
+//  a server pushes events on named topics to the connection it is serving,
+//  if that subscribed to them. an event published while a command is being
+//  served goes out once its reply is complete. the client queues pushed
+//  events as it reads them and rpc.step hands them to their callbacks.
+
+// rpc_publish( server_handle, topic, value ) --> true if pushed
+//    false if the current connection hasn't subscribed to topic
+static int rpc_publish( lua_State *L )
 {
   struct exception e;
-  ServerHandle *handle = 0;
+  ServerHandle *handle = ( ServerHandle * )luaL_checkudata( L, 1, "rpc.server_handle" );
+  int pushed = 0;
+
+  luaL_checkstring( L, 2 );
+  luaL_checkany( L, 3 );
+  lua_settop( L, 3 );
+
+  if( transport_is_open( &handle->atpt ) && handle->subs_ref != LUA_NOREF )
+  {
+    lua_rawgeti( L, LUA_REGISTRYINDEX, handle->subs_ref );
+    lua_pushvalue( L, 2 );
+    lua_rawget( L, -2 );
+    pushed = lua_toboolean( L, -1 );
+    lua_pop( L, 2 );
+  }
+
+  if( pushed )
+  {
+    Try
+    {
+      server_push( L, handle, RPC_PUSH, 2, 3 );
+    }
+    Catch( e )
+    {
+      stats_error( &handle->atpt, e.errnum );
+      transport_close( &handle->atpt );
+      pushed = 0;
+    }
+  }
+  lua_pushboolean( L, pushed );
+  return 1;
+}
+
+// rpc_set( server_handle, path, value )
+//    assigns a dotted path from the globals, as a client assignment would,
+//    so that get() revalidation and watches see the change
+static int rpc_set( lua_State *L )
+{
+  struct exception e;
+  ServerHandle *handle = ( ServerHandle * )luaL_checkudata( L, 1, "rpc.server_handle" );
+  const char *path = luaL_checkstring( L, 2 );
+  const char *dot = strrchr( path, '.' );
 
-  Try
+  luaL_checkany( L, 3 );
+  lua_settop( L, 3 );
+  if( dot )
   {
-    // make server handle
-    handle = server_handle_create( L );
+    push_path_value_or_nil( L, path, dot - path );
+    if( !lua_istable( L, -1 ) )
+    {
+      lua_pushlstring( L, path, dot - path ); // luaL_error has no %.*s
+      return luaL_error( L, "%s is not a table", lua_tostring( L, -1 ) );
+    }
+    lua_pushstring( L, dot + 1 );
+    lua_pushvalue( L, 3 );
+    lua_settable( L, -3 );
+  }
+  else
+  {
+    lua_pushvalue( L, 3 );
+    lua_setglobal( L, path );
+  }
+  version_bump( L, path, strlen( path ) );
 
-    // make listening transport
-    transport_open_listener( L, handle );
+  Try
+  {
+    server_notify_watchers( L, handle, path );
   }
   Catch( e )
   {
-    if( handle )
-      server_handle_destroy( handle );
-
-    deal_with_error( L, 0, errorString( e.errnum ) );
-    return 0;
+    stats_error( &handle->atpt, e.errnum );
+    transport_close( &handle->atpt );
   }
-  return handle;
+  return 0;
 }
 
-
-// rpc_listen( transport_indentifier ) --> server_handle
-//    transport_identifier defines where to listen, identifier type is subject to transport implementation
-static int rpc_listen( lua_State *L )
+// rpc_subscribe( handle, topic, callback )
+//    has the server push topic's events, which rpc.step passes to
+//    callback( value, topic )
+static int rpc_subscribe( lua_State *L )
 {
-  ServerHandle *handle;
+  struct exception e;
+  int freturn = 0, subscribed;
+  Handle *handle = ( Handle * )luaL_checkudata( L, 1, "rpc.handle" );
+  const char *topic = luaL_checkstring( L, 2 );
 
-  handle = rpc_listen_helper( L );
-  if ( handle == 0 )
-    return luaL_error( L, "bad handle" );
+  luaL_checktype( L, 3, LUA_TFUNCTION );
+  if( handle->subs_ref == LUA_NOREF )
+  {
+    lua_newtable( L );
+    handle->subs_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  }
+  lua_rawgeti( L, LUA_REGISTRYINDEX, handle->subs_ref );
+  lua_pushvalue( L, 2 );
+  lua_rawget( L, -2 );
+  subscribed = !lua_isnil( L, -1 );
+  lua_pop( L, 1 );
+  lua_pushvalue( L, 2 );
+  lua_pushvalue( L, 3 );
+  lua_rawset( L, -3 );
+  lua_pop( L, 1 );
+  if( subscribed )
+    return 0; // only the callback changes
 
-  return 1;
+  Try
+  {
+    helper_subscribe( L, handle, topic, 1 );
+  }
+  Catch( e )
+  {
+    freturn = generic_catch_handler( L, handle, e );
+  }
+  return freturn;
 }
 
-
-// rpc_peek( server_handle ) --> 0 or 1
-static int rpc_peek( lua_State *L )
+// rpc_unsubscribe( handle, topic )
+//    stops the server pushing topic's events. those already received are
+//    dropped.
+static int rpc_unsubscribe( lua_State *L )
 {
-  ServerHandle *handle;
-
-  check_num_args( L, 1 );
-  if ( !( lua_isuserdata( L, 1 ) && ismetatable_type( L, 1, "rpc.server_handle" ) ) )
-    return luaL_error( L, "arg must be server handle" );
+  struct exception e;
+  int freturn = 0;
+  Handle *handle = ( Handle * )luaL_checkudata( L, 1, "rpc.handle" );
+  const char *topic = luaL_checkstring( L, 2 );
 
-  handle = ( ServerHandle * )lua_touserdata( L, 1 );
+  if( handle->subs_ref == LUA_NOREF )
+    return 0;
+  lua_rawgeti( L, LUA_REGISTRYINDEX, handle->subs_ref );
+  lua_pushvalue( L, 2 );
+  lua_rawget( L, -2 );
+  if( lua_isnil( L, -1 ) )
+    return 0;
+  lua_pushvalue( L, 2 );
+  lua_pushnil( L );
+  lua_rawset( L, -4 );
+  lua_pop( L, 2 );
 
-  // if accepting transport is open, see if there is any data to read
-  if ( transport_is_open( &handle->atpt ) )
+  Try
   {
-    if ( transport_readable( &handle->atpt ) )
-      lua_pushnumber( L, 1 );
-    else
-      lua_pushnil( L );
-
-    return 1;
+    helper_subscribe( L, handle, topic, 0 );
   }
-
-  // otherwise, see if there is a new connection on the listening transport
-  if ( transport_is_open( &handle->ltpt ) )
+  Catch( e )
   {
-    if ( transport_readable( &handle->ltpt ) )
-      lua_pushnumber ( L, 1 );
-    else
-      lua_pushnil( L );
-
-    return 1;
+    freturn = generic_catch_handler( L, handle, e );
   }
-
-  lua_pushnumber( L, 0 );
-  return 1;
+  return freturn;
 }
 
-
-static void rpc_dispatch_helper( lua_State *L, ServerHandle *handle )
+// rpc_step( handle [, seconds ] ) --> events delivered
+//    reads the events pushed to the handle, waiting up to seconds (0) for
+//    the first, and calls their callbacks. events read while waiting for
+//    replies are delivered here too. the first error from a callback is
+//    raised once the others have been called.
+static int rpc_step( lua_State *L )
 {
   struct exception e;
+  Handle *handle = ( Handle * )luaL_checkudata( L, 1, "rpc.handle" );
+  Transport *tpt = &handle->tpt;
+  double seconds = luaL_optnumber( L, 2, 0 );
+  int i, n, delivered = 0, marker;
 
-  Try
+  // while a future waits, what arrives next may be its reply
+  if( transport_is_open( tpt ) && !tpt->outstanding && !tpt->header_pending )
   {
-    // if accepting transport is open, read function calls
-    if ( transport_is_open( &handle->atpt ) )
+    Try
     {
-      Try
-      {
-        switch ( transport_read_u8( &handle->atpt ) )
-        {
-          case RPC_CMD_CALL:  // call function
-            transport_write_u8( &handle->atpt, RPC_READY );
-            read_cmd_call( &handle->atpt, L );
-            break;
-          case RPC_CMD_GET: // get server-side variable for client
-            transport_write_u8( &handle->atpt, RPC_READY );
-            read_cmd_get( &handle->atpt, L );
-            break;
-          case RPC_CMD_CON: //  allow client to renegotiate active connection
-            server_negotiate( &handle->atpt );
-            break;
-          case RPC_CMD_NEWINDEX: // assign new variable on server
-            transport_write_u8( &handle->atpt, RPC_READY );
-            read_cmd_newindex( &handle->atpt, L );
-            break;
-          default: // complain and throw exception if unknown command
-            transport_write_u8(&handle->atpt, RPC_UNSUPPORTED_CMD );
-            e.type = nonfatal;
-            e.errnum = ERR_COMMAND;
-            Throw( e );
-        }
-
-        handle->link_errs = 0;
-      }
-      Catch( e )
+      helper_drain( L, tpt );
+      while( transport_wait_readable( tpt, seconds ) )
       {
-        switch( e.type )
+        marker = transport_read_u8( tpt );
+        if( marker != RPC_PUSH && marker != RPC_NOTIFY )
         {
-          case fatal: // shutdown will initiate after throw
-            Throw( e );
-
-          case nonfatal:
-            handle->link_errs++;
-            if ( handle->link_errs > MAX_LINK_ERRS )
-            {
-              handle->link_errs = 0;
-              Throw( e ); // remote connection will be closed
-            }
-            break;
-
-          default:
-            Throw( e );
+          e.errnum = ERR_PROTOCOL;
+          e.type = fatal;
+          Throw( e );
         }
+        client_read_push( L, handle, marker );
+        tpt->last_active = rpc_clock();
+        seconds = 0;
       }
     }
-    else
+    Catch( e )
     {
-      // if accepting transport is not open, accept a new connection from the
-      // listening transport
-      transport_accept( &handle->ltpt, &handle->atpt );
-
-      switch ( transport_read_u8( &handle->atpt ) )
-      {
-        case RPC_CMD_CON:
-          server_negotiate( &handle->atpt );
-          break;
-        default: // connection must be established to issue any other commands
-          e.type = nonfatal;
-          e.errnum = ERR_COMMAND;
-          Throw( e ); // remote connection will be closed
-      }
+      generic_catch_handler( L, handle, e ); // deliver what was read anyway
     }
   }
-  Catch( e )
-  {
-    switch( e.type )
-    {
-      case fatal:
-        server_handle_shutdown( handle );
-        deal_with_error( L, 0, errorString( e.errnum ) );
-        break;
 
-      case nonfatal:
-        transport_close( &handle->atpt );
-        break;
+  if( handle->events_ref == LUA_NOREF )
+  {
+    lua_pushnumber( L, 0 );
+    return 1;
+  }
 
-      default:
-        Throw( e );
+  // callbacks may subscribe or step themselves, so take the queue first
+  lua_settop( L, 1 );
+  lua_pushnil( L ); // first error from a callback
+  lua_rawgeti( L, LUA_REGISTRYINDEX, handle->events_ref );
+  luaL_unref( L, LUA_REGISTRYINDEX, handle->events_ref );
+  handle->events_ref = LUA_NOREF;
+  n = ( int )lua_objlen( L, 3 );
+  for( i = 1; i <= n; i ++ )
+  {
+    lua_rawgeti( L, 3, i );
+    lua_rawgeti( L, 4, 3 );
+    lua_rawgeti( L, LUA_REGISTRYINDEX, lua_toboolean( L, -1 ) ? handle->watches_ref :
+                                                               handle->subs_ref );
+    if( lua_istable( L, 6 ) )
+    {
+      lua_rawgeti( L, 4, 1 );
+      lua_rawget( L, 6 );
+      if( lua_istable( L, -1 ) ) // a watch's { callback, op }
+        lua_rawgeti( L, -1, 1 );
+    }
+    if( lua_isfunction( L, -1 ) )
+    {
+      lua_rawgeti( L, 4, 2 );
+      lua_rawgeti( L, 4, 1 );
+      if( lua_pcall( L, 2, 0, 0 ) == 0 )
+        delivered++;
+      else if( lua_isnil( L, 2 ) )
+        lua_replace( L, 2 );
     }
+    lua_settop( L, 3 );
   }
-}
-
-
-// rpc_dispatch( server_handle )
-static int rpc_dispatch( lua_State *L )
-{
-  ServerHandle *handle;
-  check_num_args( L, 1 );
-
-  handle = ( ServerHandle * )luaL_checkudata(L, 1, "rpc.server_handle");
-  luaL_argcheck(L, handle, 1, "server handle expected");
-
-  handle = ( ServerHandle * )lua_touserdata( L, 1 );
-
-  rpc_dispatch_helper( L, handle );
-  return 0;
-}
-
-
-// rpc_server( transport_identifier )
-static int rpc_server( lua_State *L )
-{
-  int shref;
-  ServerHandle *handle = rpc_listen_helper( L );
-
-  // Anchor handle in the registry
-  //   This is needed because garbage collection can steal our handle,
-  //   which isn't otherwise referenced
-  //
-  //   @@@ this should be replaced when we create a system for multiple
-  //   @@@ connections. such a mechanism would likely likely create a
-  //   @@@ table for multiple connections that we could service in an event loop
-
-  shref = luaL_ref( L, LUA_REGISTRYINDEX );
-  lua_rawgeti(L, LUA_REGISTRYINDEX, shref );
-
-  while ( transport_is_open( &handle->ltpt ) )
-    rpc_dispatch_helper( L, handle );
-
-  luaL_unref( L, LUA_REGISTRYINDEX, shref );
-  server_handle_destroy( handle );
-  return 0;
+  if( !lua_isnil( L, 2 ) )
+  {
+    lua_pushvalue( L, 2 );
+    return lua_error( L );
+  }
+  lua_pushnumber( L, delivered );
+  return 1;
 }
 
 // **************************************************************************
@@ -1645,6 +5936,15 @@ const LUA_REG_TYPE rpc_handle[] =
 {
   { LSTRKEY( "__index" ), LFUNCVAL( handle_index ) },
   { LSTRKEY( "__newindex"), LFUNCVAL( handle_newindex )},
+  { LSTRKEY( "__gc" ), LFUNCVAL( handle_close ) },
+  { LNILKEY, LNILVAL }
+};
+
+const LUA_REG_TYPE rpc_pool[] =
+{
+  { LSTRKEY( "__index" ), LFUNCVAL( pool_index ) },
+  { LSTRKEY( "__newindex"), LFUNCVAL( pool_newindex )},
+  { LSTRKEY( "__gc" ), LFUNCVAL( pool_gc ) },
   { LNILKEY, LNILVAL }
 };
 
@@ -1657,6 +5957,45 @@ const LUA_REG_TYPE rpc_helper[] =
   { LNILKEY, LNILVAL }
 };
 
+const LUA_REG_TYPE rpc_proxy[] =
+{
+  { LSTRKEY( "__index" ), LFUNCVAL( proxy_index ) },
+  { LSTRKEY( "__len" ), LFUNCVAL( proxy_len ) },
+  { LSTRKEY( "__pairs" ), LFUNCVAL( rpc_pairs ) },
+  { LSTRKEY( "__gc" ), LFUNCVAL( proxy_close ) },
+  { LNILKEY, LNILVAL }
+};
+
+const LUA_REG_TYPE rpc_future[] =
+{
+  { LSTRKEY( "wait" ), LFUNCVAL( future_wait ) },
+  { LSTRKEY( "cancel" ), LFUNCVAL( future_cancel ) },
+  { LSTRKEY( "__gc" ), LFUNCVAL( future_gc ) },
+#if LUA_OPTIMIZE_MEMORY > 0
+  { LSTRKEY( "__index" ), LROVAL( rpc_future ) },
+#endif
+  { LNILKEY, LNILVAL }
+};
+
+const LUA_REG_TYPE rpc_blob[] =
+{
+  { LSTRKEY( "path" ), LFUNCVAL( blob_path ) },
+  { LSTRKEY( "read" ), LFUNCVAL( blob_read ) },
+  { LSTRKEY( "close" ), LFUNCVAL( blob_close ) },
+  { LSTRKEY( "__len" ), LFUNCVAL( blob_len ) },
+  { LSTRKEY( "__gc" ), LFUNCVAL( blob_close ) },
+#if LUA_OPTIMIZE_MEMORY > 0
+  { LSTRKEY( "__index" ), LROVAL( rpc_blob ) },
+#endif
+  { LNILKEY, LNILVAL }
+};
+
+const LUA_REG_TYPE rpc_membuf[] =
+{
+  { LSTRKEY( "__gc" ), LFUNCVAL( membuf_gc ) },
+  { LNILKEY, LNILVAL }
+};
+
 const LUA_REG_TYPE rpc_server_handle[] =
 {
   { LNILKEY, LNILVAL }
@@ -1665,12 +6004,41 @@ const LUA_REG_TYPE rpc_server_handle[] =
 const LUA_REG_TYPE rpc_map[] =
 {
   {  LSTRKEY( "connect" ), LFUNCVAL( rpc_connect ) },
+  {  LSTRKEY( "pool" ), LFUNCVAL( rpc_pool_create ) },
+  {  LSTRKEY( "connect_group" ), LFUNCVAL( rpc_connect_group ) },
+  {  LSTRKEY( "endpoints" ), LFUNCVAL( rpc_endpoints ) },
   {  LSTRKEY( "close" ), LFUNCVAL( rpc_close ) },
   {  LSTRKEY( "server" ), LFUNCVAL( rpc_server ) },
   {  LSTRKEY( "on_error" ), LFUNCVAL( rpc_on_error ) },
   {  LSTRKEY( "listen" ), LFUNCVAL( rpc_listen ) },
   {  LSTRKEY( "peek" ), LFUNCVAL( rpc_peek ) },
   {  LSTRKEY( "dispatch" ), LFUNCVAL( rpc_dispatch ) },
+  {  LSTRKEY( "cache" ), LFUNCVAL( rpc_cache ) },
+  {  LSTRKEY( "pairs" ), LFUNCVAL( rpc_pairs ) },
+  {  LSTRKEY( "file_blob" ), LFUNCVAL( rpc_file_blob ) },
+  {  LSTRKEY( "blob_sink" ), LFUNCVAL( rpc_blob_sink ) },
+  {  LSTRKEY( "encode" ), LFUNCVAL( rpc_encode ) },
+  {  LSTRKEY( "decode" ), LFUNCVAL( rpc_decode ) },
+  {  LSTRKEY( "clock" ), LFUNCVAL( rpc_clock_seconds ) },
+  {  LSTRKEY( "stats" ), LFUNCVAL( rpc_stats ) },
+  {  LSTRKEY( "function_stats" ), LFUNCVAL( rpc_function_stats ) },
+  {  LSTRKEY( "slow_log" ), LFUNCVAL( rpc_slow_log ) },
+  {  LSTRKEY( "slow_calls" ), LFUNCVAL( rpc_slow_calls ) },
+  {  LSTRKEY( "sleep" ), LFUNCVAL( rpc_sleep ) },
+  {  LSTRKEY( "deadline" ), LFUNCVAL( rpc_deadline ) },
+  {  LSTRKEY( "remaining" ), LFUNCVAL( rpc_remaining ) },
+  {  LSTRKEY( "cancelled" ), LFUNCVAL( rpc_cancelled ) },
+  {  LSTRKEY( "timeout" ), LFUNCVAL( rpc_timeout ) },
+  {  LSTRKEY( "ping" ), LFUNCVAL( rpc_ping ) },
+  {  LSTRKEY( "reconnect" ), LFUNCVAL( rpc_reconnect ) },
+  {  LSTRKEY( "heartbeat" ), LFUNCVAL( rpc_heartbeat ) },
+  {  LSTRKEY( "keepalive" ), LFUNCVAL( rpc_keepalive ) },
+  {  LSTRKEY( "idle_timeout" ), LFUNCVAL( rpc_idle_timeout ) },
+  {  LSTRKEY( "publish" ), LFUNCVAL( rpc_publish ) },
+  {  LSTRKEY( "set" ), LFUNCVAL( rpc_set ) },
+  {  LSTRKEY( "subscribe" ), LFUNCVAL( rpc_subscribe ) },
+  {  LSTRKEY( "unsubscribe" ), LFUNCVAL( rpc_unsubscribe ) },
+  {  LSTRKEY( "step" ), LFUNCVAL( rpc_step ) },
 //  {  LSTRKEY( "rpc_async" ), LFUNCVAL( rpc_async ) },
 #if LUA_OPTIMIZE_MEMORY > 0
 // {  LSTRKEY("mode"), LSTRVAL( LUARPC_MODE ) },
@@ -1681,9 +6049,15 @@ const LUA_REG_TYPE rpc_map[] =
 
 LUALIB_API int luaopen_rpc(lua_State *L)
 {
+  helper_cache_init( L );
 #if LUA_OPTIMIZE_MEMORY > 0
   luaL_rometatable(L, "rpc.helper", (void*)rpc_helper);
   luaL_rometatable(L, "rpc.handle", (void*)rpc_handle);
+  luaL_rometatable(L, "rpc.pool", (void*)rpc_pool);
+  luaL_rometatable(L, "rpc.proxy", (void*)rpc_proxy);
+  luaL_rometatable(L, "rpc.future", (void*)rpc_future);
+  luaL_rometatable(L, "rpc.blob", (void*)rpc_blob);
+  luaL_rometatable(L, "rpc.membuf", (void*)rpc_membuf);
   luaL_rometatable(L, "rpc.server_handle", (void*)rpc_server_handle);
 #else
   luaL_register( L, "rpc", rpc_map );
@@ -1696,6 +6070,25 @@ LUALIB_API int luaopen_rpc(lua_State *L)
   luaL_newmetatable( L, "rpc.handle" );
   luaL_register( L, NULL, rpc_handle );
 
+  luaL_newmetatable( L, "rpc.pool" );
+  luaL_register( L, NULL, rpc_pool );
+
+  luaL_newmetatable( L, "rpc.proxy" );
+  luaL_register( L, NULL, rpc_proxy );
+
+  luaL_newmetatable( L, "rpc.future" );
+  luaL_register( L, NULL, rpc_future );
+  lua_pushvalue( L, -1 );
+  lua_setfield( L, -2, "__index" );
+
+  luaL_newmetatable( L, "rpc.blob" );
+  luaL_register( L, NULL, rpc_blob );
+  lua_pushvalue( L, -1 );
+  lua_setfield( L, -2, "__index" );
+
+  luaL_newmetatable( L, "rpc.membuf" );
+  luaL_register( L, NULL, rpc_membuf );
+
   luaL_newmetatable( L, "rpc.server_handle" );
 #endif
   return 1;
@@ -1707,6 +6100,15 @@ static const luaL_reg rpc_handle[] =
 {
   { "__index", handle_index },
   { "__newindex", handle_newindex },
+  { "__gc", handle_close },
+  { NULL, NULL }
+};
+
+static const luaL_reg rpc_pool[] =
+{
+  { "__index", pool_index },
+  { "__newindex", pool_newindex },
+  { "__gc", pool_gc },
   { NULL, NULL }
 };
 
@@ -1719,6 +6121,39 @@ static const luaL_reg rpc_helper[] =
   { NULL, NULL }
 };
 
+static const luaL_reg rpc_proxy[] =
+{
+  { "__index", proxy_index },
+  { "__len", proxy_len },
+  { "__pairs", rpc_pairs },
+  { "__gc", proxy_close },
+  { NULL, NULL }
+};
+
+static const luaL_reg rpc_future[] =
+{
+  { "wait", future_wait },
+  { "cancel", future_cancel },
+  { "__gc", future_gc },
+  { NULL, NULL }
+};
+
+static const luaL_reg rpc_blob[] =
+{
+  { "path", blob_path },
+  { "read", blob_read },
+  { "close", blob_close },
+  { "__len", blob_len },
+  { "__gc", blob_close },
+  { NULL, NULL }
+};
+
+static const luaL_reg rpc_membuf[] =
+{
+  { "__gc", membuf_gc },
+  { NULL, NULL }
+};
+
 static const luaL_reg rpc_server_handle[] =
 {
   { NULL, NULL }
@@ -1727,12 +6162,41 @@ static const luaL_reg rpc_server_handle[] =
 static const luaL_reg rpc_map[] =
 {
   { "connect", rpc_connect },
+  { "pool", rpc_pool_create },
+  { "connect_group", rpc_connect_group },
+  { "endpoints", rpc_endpoints },
   { "close", rpc_close },
   { "server", rpc_server },
   { "on_error", rpc_on_error },
   { "listen", rpc_listen },
   { "peek", rpc_peek },
   { "dispatch", rpc_dispatch },
+  { "cache", rpc_cache },
+  { "pairs", rpc_pairs },
+  { "file_blob", rpc_file_blob },
+  { "blob_sink", rpc_blob_sink },
+  { "encode", rpc_encode },
+  { "decode", rpc_decode },
+  { "clock", rpc_clock_seconds },
+  { "stats", rpc_stats },
+  { "function_stats", rpc_function_stats },
+  { "slow_log", rpc_slow_log },
+  { "slow_calls", rpc_slow_calls },
+  { "sleep", rpc_sleep },
+  { "deadline", rpc_deadline },
+  { "remaining", rpc_remaining },
+  { "cancelled", rpc_cancelled },
+  { "timeout", rpc_timeout },
+  { "ping", rpc_ping },
+  { "reconnect", rpc_reconnect },
+  { "heartbeat", rpc_heartbeat },
+  { "keepalive", rpc_keepalive },
+  { "idle_timeout", rpc_idle_timeout },
+  { "publish", rpc_publish },
+  { "set", rpc_set },
+  { "subscribe", rpc_subscribe },
+  { "unsubscribe", rpc_unsubscribe },
+  { "step", rpc_step },
 //  { "rpc_async", rpc_async },
   { NULL, NULL }
 };
@@ -1740,6 +6204,7 @@ static const luaL_reg rpc_map[] =
 
 LUALIB_API int luaopen_rpc(lua_State *L)
 {
+  helper_cache_init( L );
   luaL_register( L, "rpc", rpc_map );
   lua_pushstring(L, LUARPC_MODE);
   lua_setfield(L, -2, "mode");
@@ -1750,6 +6215,25 @@ LUALIB_API int luaopen_rpc(lua_State *L)
   luaL_newmetatable( L, "rpc.handle" );
   luaL_register( L, NULL, rpc_handle );
 
+  luaL_newmetatable( L, "rpc.pool" );
+  luaL_register( L, NULL, rpc_pool );
+
+  luaL_newmetatable( L, "rpc.proxy" );
+  luaL_register( L, NULL, rpc_proxy );
+
+  luaL_newmetatable( L, "rpc.future" );
+  luaL_register( L, NULL, rpc_future );
+  lua_pushvalue( L, -1 );
+  lua_setfield( L, -2, "__index" );
+
+  luaL_newmetatable( L, "rpc.blob" );
+  luaL_register( L, NULL, rpc_blob );
+  lua_pushvalue( L, -1 );
+  lua_setfield( L, -2, "__index" );
+
+  luaL_newmetatable( L, "rpc.membuf" );
+  luaL_register( L, NULL, rpc_membuf );
+
   luaL_newmetatable( L, "rpc.server_handle" );
 
   return 1;
@@ -1,4 +1,6 @@
 
+#include <stdio.h>
+
 #include "cexcept.h"
 #include "type.h"
 #include "serial.h"
@@ -7,10 +9,30 @@
 /****************************************************************************/
 // Parameters
 
-#define NUM_FUNCNAME_CHARS 20 // Maximum function name length
-
 #define MAX_LINK_ERRS ( 2 ) // Maximum number of framing errors before connection reset
 
+#define PROXY_PAGE_SIZE ( 64 ) // Table entries fetched per request when iterating a proxy
+
+#define STREAM_CHUNK_BYTES ( 65536 ) // Default string bytes per stream chunk
+#define STREAM_CHUNK_ENTRIES ( 1024 ) // Default table entries per stream chunk
+#define MAX_STREAMS ( 16 ) // Streams a connection may hold open on the server
+
+#define NUMARRAY_MIN ( 4 ) // Smallest all-number array sent packed
+#define NUMARRAY_BLOCK ( 256 ) // Numbers converted per block of a packed array
+
+#define STATS_COMMANDS ( 16 ) // Command bytes counted individually by rpc.stats
+#define FSTAT_BUCKETS ( 448 ) // Latency histogram buckets, enough for 2^30us
+
+#define SERIAL_TIMEOUT_MS ( 1000 ) // Default serial read timeout
+#define HEARTBEAT_TIMEOUT ( 5.0 ) // Default seconds to wait for a ping reply
+#define RECONNECT_MIN_DELAY ( 0.1 ) // Seconds before retrying a failed reconnect
+#define RECONNECT_MAX_DELAY ( 30.0 ) // Default limit on the reconnect backoff
+#define HEDGE_SAMPLES ( 64 ) // Recent call times kept per endpoint for hedging
+#define HEDGE_MIN_SAMPLES ( 10 ) // Call times needed before hedging starts
+
+#define SLOW_LOG_ENTRIES ( 128 ) // Default slow calls remembered by a server
+#define SLOW_NAME_CHARS ( 64 ) // Function path and peer chars kept per slow call
+
 #if defined( LUARPC_ENABLE_SERIAL )
 #define LUARPC_MODE "serial"
 #define tpt_handler ser_handler
@@ -48,6 +70,24 @@ typedef int tpt_handler;
 #define MYASSERT(a) ;
 #endif
 
+// Static tracing probes (USDT) for bpftrace, perf or systemtap, under the
+// provider name "luarpc". built in with LUARPC_USDT, where sys/sdt.h exists;
+// a probe that nobody is tracing costs a nop.
+#ifdef LUARPC_USDT
+#include <sys/sdt.h>
+#define RPC_PROBE1(name,a) DTRACE_PROBE1(luarpc,name,a)
+#define RPC_PROBE2(name,a,b) DTRACE_PROBE2(luarpc,name,a,b)
+#define RPC_PROBE3(name,a,b,c) DTRACE_PROBE3(luarpc,name,a,b,c)
+#define RPC_PROBE4(name,a,b,c,d) DTRACE_PROBE4(luarpc,name,a,b,c,d)
+#define RPC_PROBE5(name,a,b,c,d,e) DTRACE_PROBE5(luarpc,name,a,b,c,d,e)
+#else
+#define RPC_PROBE1(name,a) ((void)0)
+#define RPC_PROBE2(name,a,b) ((void)0)
+#define RPC_PROBE3(name,a,b,c) ((void)0)
+#define RPC_PROBE4(name,a,b,c,d) ((void)0)
+#define RPC_PROBE5(name,a,b,c,d,e) ((void)0)
+#endif
+
 //****************************************************************************
 // Error Messages & Exceptions
 
@@ -71,7 +111,22 @@ enum {
   ERR_NODATA    = MAXINT - 103,
   ERR_COMMAND   = MAXINT - 106,
   ERR_HEADER    = MAXINT - 107,
-  ERR_LONGFNAME = MAXINT - 108
+  ERR_TIMEOUT   = MAXINT - 108,  // a call's deadline passed
+  ERR_BUSY      = MAXINT - 109,  // command sent while a future is outstanding
+  ERR_CANCELLED = MAXINT - 110   // the client cancelled a call
+};
+
+// classes errors are counted in by rpc.stats
+enum {
+  STAT_ERR_EOF,
+  STAT_ERR_CLOSED,
+  STAT_ERR_PROTOCOL,
+  STAT_ERR_NODATA,
+  STAT_ERR_COMMAND,
+  STAT_ERR_HEADER,
+  STAT_ERR_TIMEOUT,
+  STAT_ERR_SYSTEM,                    // any errno from the transport
+  STAT_ERR_CLASSES
 };
 
 enum exception_type { done, nonfatal, fatal };
@@ -88,11 +143,41 @@ extern struct exception_context the_exception_context[ 1 ];
 //****************************************************************************
 // LuaRPC Structures
 
+// In-memory buffer standing in for a connection
+typedef struct _MemBuf MemBuf;
+struct _MemBuf
+{
+  u8 *data;                           // contents
+  size_t size;                        // bytes allocated, 0 if data isn't ours
+  size_t len;                         // bytes written
+  size_t pos;                         // bytes read
+};
+
+// Connection counters, plain increments that are only gathered by rpc.stats
+typedef struct _Stats Stats;
+struct _Stats
+{
+  uint64_t bytes_in;                  // bytes read
+  uint64_t bytes_out;                 // bytes written
+  uint64_t reads;                     // read system calls
+  uint64_t writes;                    // write system calls
+  uint64_t commands[ STATS_COMMANDS ];// commands sent or served, by RPC_CMD_*
+  uint64_t errors[ STAT_ERR_CLASSES ];// errors caught, by STAT_ERR_*
+  uint64_t link_errs;                 // nonfatal errors a server let pass
+  uint64_t connects;                  // connections made or accepted
+  uint64_t reconnects;                // connections remade after a failure
+  uint64_t expired;                   // calls skipped, their deadline had passed
+  uint64_t cancelled;                 // calls the client cancelled
+  uint64_t pushes;                    // events pushed or received
+};
+
 // Transport Connection Structure
 typedef struct _Transport Transport;
+struct _Codec;
 struct _Transport 
 {
   tpt_handler fd;
+  const struct _Codec *codec;         // number & length coding picked by negotiation
   unsigned tmr_id;
   u32    loc_little: 1,               // Local is little endian?
          loc_armflt: 1,               // local float representation is arm float?
@@ -100,6 +185,20 @@ struct _Transport
          net_little: 1,               // Network is little endian?
          net_intnum: 1;               // Network is integer only?
   u8     lnum_bytes;
+  int    blob_sink;                   // directory receiving blobs, reference idx
+                                      // in registry or LUA_NOREF for strings
+  MemBuf *mem;                        // buffer used instead of fd, or NULL
+  u32    pending;                     // replies to calls given up on, skipped
+                                      // before the next command
+  u32    outstanding;                 // id of the call a future is waiting
+                                      // on, 0 for none
+  double heartbeat;                   // ping before a command after this
+                                      // many idle seconds, 0 for never
+  double heartbeat_timeout;           // seconds to wait for a ping reply
+  double last_active;                 // when the peer was last heard from
+  int    header_pending;              // server's header not yet read after
+                                      // a reconnect
+  Stats  stats;
 };
 
 typedef struct _Handle Handle;
@@ -109,6 +208,71 @@ struct _Handle
   int error_handler;                  // function reference
   int async;                          // nonzero if async mode being used
   int read_reply_count;               // number of async call return values to read
+  int cache_ref;                      // get() cache table reference, or LUA_NOREF
+  int cache_validate;                 // nonzero to revalidate expired cache entries
+  double cache_ttl;                   // seconds a cached get() result stays fresh
+  u32 deadline_ms;                    // default call deadline, 0 for none
+  u32 call_id;                        // id of the last call sent with a deadline
+  int connect_ref;                    // rpc.connect arguments, reference idx
+                                      // in registry
+  int reconnect;                      // nonzero to reopen a closed connection
+  double reconnect_delay;             // seconds to wait after a failed reopen
+  double reconnect_max;               // limit on reconnect_delay
+  double reconnect_at;                // no reopen attempts before this time
+  u32 timeout_ms;                     // rpc.timeout setting, for reconnects
+  u32 keepalive[ 3 ];                 // rpc.keepalive idle, interval, count
+  int endpoint;                       // index in its pool's endpoints
+  int subs_ref;                       // callbacks by subscribed topic,
+                                      // reference idx in registry
+  int events_ref;                     // pushed events not yet delivered,
+                                      // reference idx in registry
+  int watches_ref;                    // { callback, op } by watched path,
+                                      // reference idx in registry
+};
+
+// One server of a pool or group
+typedef struct _Endpoint Endpoint;
+struct _Endpoint {
+  int args_ref;                       // rpc.connect arguments, reference idx
+                                      // in registry
+  int connections;                    // connections opened, counted by
+  u32 outstanding;                    // and calls outstanding, pool_count
+  double latency;                     // moving average of call times
+  u32 failures;                       // transport failures in a row
+  double ejected_until;               // left out of choices until then
+  int skip;                           // nonzero if busy for this checkout
+  double recent[ HEDGE_SAMPLES ];     // latest call times, a ring
+  u32 nrecent;                        // call times recorded
+  u32 hedges;                         // hedged calls sent here as the second
+  u32 hedge_wins;                     // and of those, answered first
+  uint64_t seed;                      // hash of its address, for rendezvous
+  Handle *fanout;                     // connection a fanout call went out on
+  int unread;                         // nonzero until its reply is read
+};
+
+// how a group chooses an endpoint for each call. the hashing policies
+// choose by one of the call's arguments, so a key always goes to the same
+// endpoint.
+enum { POLICY_ROUND_ROBIN, POLICY_LEAST, POLICY_P2C, POLICY_RENDEZVOUS, POLICY_JUMP };
+
+// Connections to one or more identical servers, used like a handle
+typedef struct _Pool Pool;
+struct _Pool {
+  int handles_ref;                    // connections, reference idx in registry
+  int size;                           // most connections to each endpoint
+  int warm;                           // connections opened up front
+  int policy;                         // POLICY_*
+  u32 next;                           // round robin position
+  double check_idle;                  // ping connections idle this long
+  double check_timeout;               // seconds to wait for that ping
+  u32 eject_after;                    // failures in a row ejecting an endpoint
+  double eject_for;                   // seconds an ejected endpoint is left out
+  int shard_key;                      // call argument hashed to choose an
+                                      // endpoint, 0 unless sharded
+  int *candidates;                    // scratch space for pool_choose
+  int nendpoints;
+  Endpoint endpoints[];               // allocated inline, followed by the
+                                      // candidates array
 };
 
 typedef struct _Helper Helper;
@@ -117,7 +281,75 @@ struct _Helper {
 	Helper *parent;                     // parent helper
   int pref;                           // Parent reference idx in registry
 	u8 nparents;                        // number of parents
-  char funcname[NUM_FUNCNAME_CHARS];  // name of the function
+  u32 deadline_ms;                    // call deadline, 0 to use the handle's
+  int hedged;                         // nonzero to hedge calls across a group
+  Pool *pool;                         // pool handle is checked out of, or NULL
+  char funcname[];                    // name of the function, allocated
+                                      // inline with the userdata
+};
+
+typedef struct _Proxy Proxy;
+struct _Proxy {
+  Helper *helper;                     // helper naming the remote table
+  int href;                           // Helper reference idx in registry
+  int vref;                           // fetched values, reference idx in registry
+  int sref;                           // fetched key order, reference idx in registry
+  int len;                            // remote length, or -1 if not yet fetched
+  int complete;                       // nonzero once every entry has been fetched
+};
+
+// The reply to a call, collected later
+enum { FUTURE_WAITING, FUTURE_DONE, FUTURE_CANCELLED };
+
+typedef struct _Future Future;
+struct _Future {
+  Handle *handle;                     // handle the call was made on
+  int href;                           // Handle reference idx in registry
+  u32 id;                             // call id, echoed in the reply
+  int state;                          // FUTURE_*
+  struct _Pool *pool;                 // pool the call went through, or NULL
+  double sent;                        // when the call was sent
+};
+
+typedef struct _Blob Blob;
+struct _Blob {
+  FILE *file;                         // file holding the data, NULL once closed
+  u32 offset;                         // position of the data in the file
+  u32 length;                         // number of bytes
+  char path[];                        // name of the file
+};
+
+// Latency of the calls made to one server function, by phase. histogram
+// buckets are exact below 16us, then 16 to each power of two.
+enum { FSTAT_DECODE, FSTAT_CALL, FSTAT_ENCODE, FSTAT_PHASES };
+
+typedef struct _FuncStats FuncStats;
+struct _FuncStats {
+  u32 calls;                          // calls completed
+  u32 errors;                         // calls that raised an error
+  double total[ FSTAT_PHASES ];       // seconds spent
+  double max[ FSTAT_PHASES ];         // longest time taken, in seconds
+  u32 buckets[ FSTAT_PHASES ][ FSTAT_BUCKETS ];
+};
+
+// A call that took longer than a server's slow call threshold
+typedef struct _SlowCall SlowCall;
+struct _SlowCall {
+  double at;                          // wall clock time the call finished
+  double phase[ FSTAT_PHASES ];       // seconds spent, as in FuncStats
+  u32 request_bytes;                  // name and arguments received
+  u32 reply_bytes;                    // results or error sent
+  char path[ SLOW_NAME_CHARS ];       // function called, truncated
+  char peer[ SLOW_NAME_CHARS ];       // client address
+};
+
+// Ring buffer of the most recent slow calls
+typedef struct _SlowLog SlowLog;
+struct _SlowLog {
+  double threshold;                   // seconds a call must take to be kept
+  u32 size;                           // entries in the ring
+  u32 count;                          // calls recorded, including overwritten
+  SlowCall calls[];
 };
 
 typedef struct _ServerHandle ServerHandle;
@@ -125,6 +357,21 @@ struct _ServerHandle {
   Transport ltpt;   // listening transport, always valid if no error
   Transport atpt;   // accepting transport, valid if connection established
 	int link_errs;
+  int streams;      // open streams table reference idx in registry
+  u32 stream_seq;   // id of the most recently opened stream
+  int fstats;       // FuncStats by function name, reference idx in registry
+  SlowLog *slow;    // slow call log, or NULL when not enabled
+  int slow_ref;     // slow call log, reference idx in registry
+  int peeked;       // command byte read while looking for a cancel, or -1
+  int cancelled;    // nonzero once the call being served is cancelled
+  int call_tagged;  // nonzero while serving a call with an id
+  u32 call_id;      // id of the call being served, for rpc.cancelled()
+  double call_deadline; // deadline of the call being served, or 0
+  double idle_timeout; // close a connection silent this long, 0 for never
+  int subs_ref;     // topics the connection subscribed to, reference idx
+  int watches_ref;  // paths the connection watches, reference idx
+  int pushes_ref;   // events published while serving, reference idx
+  int serving;      // nonzero while a command is being served
 };
 
 
@@ -136,7 +383,7 @@ struct _ServerHandle {
 #endif
 
 #define TRANSPORT_VERIFY_OPEN \
-	if (tpt->fd == INVALID_TRANSPORT) \
+	if (tpt->fd == INVALID_TRANSPORT && tpt->mem == NULL) \
 	{ \
 		e.errnum = ERR_CLOSED; \
 		e.type = fatal; \
@@ -148,6 +395,10 @@ int check_num_args (lua_State *L, int desired_n);
 void deal_with_error (lua_State *L, Handle *h, const char *error_string);
 void my_lua_error( lua_State *L, const char *errmsg );
 
+// Memory Buffers, read and written by the transport when tpt->mem is set
+void membuf_read( MemBuf *mb, u8 *buffer, int length );
+void membuf_write( MemBuf *mb, const u8 *buffer, int length );
+
 // TRANSPORT API 
 
 // Setup Transport 
@@ -166,6 +417,30 @@ void transport_accept (Transport *tpt, Transport *atpt);
 void transport_read_buffer (Transport *tpt, u8 *buffer, int length);
 void transport_write_buffer (Transport *tpt, const u8 *buffer, int length);
 
+// Send part of a file, without staging it in memory where the link allows
+void transport_write_file (Transport *tpt, FILE *f, u32 offset, u32 length);
+
+// Receive data straight into a file
+void transport_read_file (Transport *tpt, FILE *f, u32 length);
+
+// Describe the other end of a connection, e.g. its address
+void transport_peer_name (Transport *tpt, char *buffer, size_t length);
+
+// Wait up to a number of seconds for data to read:
+// 		- 1 = data available, 0 = timed out
+int transport_wait_readable (Transport *tpt, double seconds);
+
+// Wait up to a number of seconds for data to read on any of n transports:
+// 		- index of one with data available, -1 = timed out
+int transport_wait_any (Transport **tpts, int n, double seconds);
+
+// Give up on reads and writes that block for longer than ms (0 = never)
+void transport_set_timeout (Transport *tpt, u32 ms);
+
+// Probe an idle connection after idle seconds, every interval seconds,
+// dropping it after count probes go unanswered (idle 0 = off)
+void transport_set_keepalive (Transport *tpt, u32 idle, u32 interval, u32 count);
+
 // Check if data is available on connection without reading:
 // 		- 1 = data available, 0 = no data available
 int transport_readable (Transport *tpt);
@@ -25,6 +25,8 @@ void transport_open( Transport *tpt, const char *path );
 void transport_init (Transport *tpt)
 {
   tpt->fd = INVALID_TRANSPORT;
+  tpt->blob_sink = LUA_NOREF;
+  tpt->mem = NULL;
 }
 
 void transport_open( Transport *tpt, const char *path )
@@ -41,7 +43,7 @@ void transport_open( Transport *tpt, const char *path )
   }
   
   ser_setup( tpt->fd, 115200, SER_DATABITS_8, SER_PARITY_NONE, SER_STOPBITS_1 );
-  ser_set_timeout_ms( tpt->fd, 1000 );
+  ser_set_timeout_ms( tpt->fd, SERIAL_TIMEOUT_MS );
 }
 
 // Open Listener / Server 
@@ -84,6 +86,11 @@ void transport_read_buffer (Transport *tpt, u8 *buffer, int length)
 {
   u32 n;
   struct exception e;
+  if( tpt->mem )
+  {
+    membuf_read( tpt->mem, buffer, length );
+    return;
+  }
   TRANSPORT_VERIFY_OPEN;
   
   while( length > 0 )
@@ -91,6 +98,8 @@ void transport_read_buffer (Transport *tpt, u8 *buffer, int length)
     TRANSPORT_VERIFY_OPEN;
 
     n = ser_read( tpt->fd, buffer, length );
+    tpt->stats.reads++;
+    RPC_PROBE3( transport__read, ( int )tpt->fd, ( int )n, n == 0 ? ERR_NODATA : 0 );
     
     // error handling
     if( n == 0 )
@@ -107,6 +116,7 @@ void transport_read_buffer (Transport *tpt, u8 *buffer, int length)
       Throw( e );
     }
    
+    tpt->stats.bytes_in += n;
     buffer += n;
     length -= n;
   }
@@ -116,9 +126,16 @@ void transport_write_buffer( Transport *tpt, const u8 *buffer, int length )
 {
   int n;
   struct exception e;
+  if( tpt->mem )
+  {
+    membuf_write( tpt->mem, buffer, length );
+    return;
+  }
   TRANSPORT_VERIFY_OPEN;
 
   n = ser_write( tpt->fd, buffer, length );
+  tpt->stats.writes++;
+  RPC_PROBE3( transport__write, ( int )tpt->fd, n, n != length ? transport_errno : 0 );
 
   if ( n != length )
   {
@@ -126,6 +143,110 @@ void transport_write_buffer( Transport *tpt, const u8 *buffer, int length )
     e.type = fatal;
     Throw( e );
   }
+  tpt->stats.bytes_out += n;
+}
+
+// Send part of a file through a buffer
+void transport_write_file( Transport *tpt, FILE *f, u32 offset, u32 length )
+{
+  struct exception e;
+  u8 buffer[ BUFSIZ ];
+  size_t n;
+  TRANSPORT_VERIFY_OPEN;
+
+  if( fseek( f, offset, SEEK_SET ) != 0 )
+  {
+    e.errnum = errno;
+    e.type = fatal;
+    Throw( e );
+  }
+  while( length > 0 )
+  {
+    n = fread( buffer, 1, length < sizeof( buffer ) ? length : sizeof( buffer ), f );
+    if( n == 0 )
+    {
+      e.errnum = EIO; // file shorter than blob
+      e.type = fatal;
+      Throw( e );
+    }
+    transport_write_buffer( tpt, buffer, n );
+    length -= n;
+  }
+}
+
+// Receive data into a file
+void transport_read_file( Transport *tpt, FILE *f, u32 length )
+{
+  struct exception e;
+  u8 buffer[ BUFSIZ ];
+  u32 n;
+
+  while( length > 0 )
+  {
+    n = length < sizeof( buffer ) ? length : sizeof( buffer );
+    transport_read_buffer( tpt, buffer, n );
+    if( fwrite( buffer, 1, n, f ) != n )
+    {
+      e.errnum = errno;
+      e.type = fatal;
+      Throw( e );
+    }
+    length -= n;
+  }
+}
+
+// Wait up to a number of seconds for data to read:
+//    - 1 = data available, 0 = timed out
+int transport_wait_readable( Transport *tpt, double seconds )
+{
+  struct exception e;
+  int ret;
+
+  if( tpt->fd == INVALID_TRANSPORT )
+    return 0;
+
+  ret = ser_wait_readable( tpt->fd, seconds > 0 ? ( u32 )( seconds * 1000 ) : 0 );
+  if( ret < 0 )
+  {
+    e.errnum = transport_errno;
+    e.type = fatal;
+    Throw( e );
+  }
+  return ( ret > 0 );
+}
+
+// Wait up to a number of seconds for data to read on any of n transports:
+//    - index of one with data available, -1 = timed out
+// serial ports are polled in turn, a millisecond each
+int transport_wait_any( Transport **tpts, int n, double seconds )
+{
+  u32 ms = seconds > 0 ? ( u32 )( seconds * 1000 ) : 0, waited = 0;
+  int i;
+
+  do
+  {
+    for( i = 0; i < n; i ++ )
+      if( transport_wait_readable( tpts[ i ], 0.001 ) )
+        return i;
+    waited += n;
+  } while( waited < ms );
+  return -1;
+}
+
+// Give up on reads that block for longer than ms (0 = never)
+void transport_set_timeout( Transport *tpt, u32 ms )
+{
+  if( tpt->fd != INVALID_TRANSPORT )
+    ser_set_timeout_ms( tpt->fd, ms ? ms : SER_INF_TIMEOUT );
+}
+
+// A serial link has no keepalive; use heartbeats instead
+void transport_set_keepalive( Transport *tpt, u32 idle, u32 interval, u32 count )
+{
+  ( void )tpt;
+  ( void )idle;
+  ( void )interval;
+  ( void )count;
 }
 
 // Check if data is available on connection without reading:
@@ -150,6 +271,13 @@ int transport_readable (Transport *tpt)
   return ( ret > 0 );
 }
 
+// Describe the other end of a connection; a serial link has only one
+void transport_peer_name( Transport *tpt, char *buffer, size_t length )
+{
+  ( void )tpt;
+  snprintf( buffer, length, "serial" );
+}
+
 // Check if transport is open:
 //    1 = connection open, 0 = connection closed
 int transport_is_open (Transport *tpt)
@@ -28,7 +28,11 @@
 #include <sys/socket.h>
 #include <netinet/tcp.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <sys/time.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 #endif /* END NEEDED INCLUDES W/ SOCKETS */
 
@@ -182,6 +186,8 @@ static int get_port_number (lua_State *L, int i)
 void transport_init (Transport *tpt)
 {
   tpt->fd = INVALID_TRANSPORT;
+  tpt->blob_sink = LUA_NOREF;
+  tpt->mem = NULL;
 }
 
 /* see if a socket is open */
@@ -296,9 +302,15 @@ void transport_accept (Transport *tpt, Transport *atpt)
 void transport_read_buffer (Transport *tpt, u8 *buffer, int length)
 {
    struct exception e;
+  if (tpt->mem) {
+    membuf_read (tpt->mem, buffer, length);
+    return;
+  }
   TRANSPORT_VERIFY_OPEN;
   while (length > 0) {
     int n = read (tpt->fd,(void*) buffer,length);
+    tpt->stats.reads++;
+    RPC_PROBE3(transport__read, tpt->fd, n, n < 0 ? sock_errno : 0);
     if (n == 0) 
     {
       e.errnum = ERR_EOF;
@@ -313,6 +325,7 @@ void transport_read_buffer (Transport *tpt, u8 *buffer, int length)
       Throw( e );
     }
 
+    tpt->stats.bytes_in += n;
     buffer += n;
     length -= n;
   }
@@ -324,14 +337,97 @@ void transport_write_buffer (Transport *tpt, const u8 *buffer, int length)
 {
   struct exception e;
   int n;
+  if (tpt->mem) {
+    membuf_write (tpt->mem, buffer, length);
+    return;
+  }
+  TRANSPORT_VERIFY_OPEN;
+  while (length > 0) {
+    n = write (tpt->fd,buffer,length);
+    tpt->stats.writes++;
+    RPC_PROBE3(transport__write, tpt->fd, n, n < 0 ? sock_errno : 0);
+    if (n <= 0) 
+    {
+      e.errnum = sock_errno;
+      e.type = fatal;
+      Throw( e );
+    }
+    tpt->stats.bytes_out += n;
+    buffer += n;
+    length -= n;
+  }
+}
+
+/* send part of a file. on linux the kernel copies it from the page cache
+ * with sendfile, elsewhere it goes through a buffer.
+ */
+
+void transport_write_file (Transport *tpt, FILE *f, u32 offset, u32 length)
+{
+  struct exception e;
+  u8 buffer[ BUFSIZ ];
+  size_t n;
   TRANSPORT_VERIFY_OPEN;
-  n = write (tpt->fd,buffer,length);
-  if (n != length) 
+
+#ifdef __linux__
+  if (tpt->mem == NULL)
   {
-    e.errnum = sock_errno;
+    off_t off = offset;
+    while (length > 0) {
+      ssize_t sent = sendfile (tpt->fd, fileno (f), &off, length);
+      tpt->stats.writes++;
+      RPC_PROBE3(transport__write, tpt->fd, (int) sent, sent < 0 ? sock_errno : 0);
+      if (sent <= 0) {
+        if (sent < 0 && (errno == EINVAL || errno == ENOSYS))
+          break; /* not supported for this file, use the buffer */
+        e.errnum = sent == 0 ? EIO : sock_errno; /* file shorter than blob */
+        e.type = fatal;
+        Throw( e );
+      }
+      tpt->stats.bytes_out += sent;
+      length -= sent;
+    }
+    offset = off;
+  }
+#endif
+
+  if (length > 0 && fseek (f, offset, SEEK_SET) != 0)
+  {
+    e.errnum = errno;
     e.type = fatal;
     Throw( e );
   }
+  while (length > 0) {
+    n = fread (buffer, 1, length < sizeof (buffer) ? length : sizeof (buffer), f);
+    if (n == 0)
+    {
+      e.errnum = EIO; /* file shorter than blob */
+      e.type = fatal;
+      Throw( e );
+    }
+    transport_write_buffer (tpt, buffer, n);
+    length -= n;
+  }
+}
+
+/* receive data into a file */
+
+void transport_read_file (Transport *tpt, FILE *f, u32 length)
+{
+  struct exception e;
+  u8 buffer[ BUFSIZ ];
+  u32 n;
+  while (length > 0) {
+    n = length < sizeof (buffer) ? length : sizeof (buffer);
+    transport_read_buffer (tpt, buffer, n);
+    if (fwrite (buffer, 1, n, f) != n)
+    {
+      e.errnum = errno;
+      e.type = fatal;
+      Throw( e );
+    }
+    length -= n;
+  }
 }
 
 int transport_open_connection(lua_State *L, Handle *handle)
@@ -380,6 +476,141 @@ void transport_open_listener(lua_State *L, ServerHandle *handle)
   transport_listen (&handle->ltpt,MAXCON);
 }
 
+/* describe the other end of a connection as address:port */
+
+void transport_peer_name (Transport *tpt, char *buffer, size_t length)
+{
+  struct sockaddr_in peer;
+  socklen_t namesize = sizeof (peer);
+  char address[ INET_ADDRSTRLEN ];
+
+  if (tpt->fd == INVALID_TRANSPORT ||
+      getpeername (tpt->fd, (struct sockaddr *) &peer, &namesize) != 0 ||
+      inet_ntop (AF_INET, &peer.sin_addr, address, sizeof (address)) == NULL)
+    snprintf (buffer, length, "unknown");
+  else
+    snprintf (buffer, length, "%s:%d", address, ntohs (peer.sin_port));
+}
+
+/* wait up to a number of seconds for data to read. return 1 if there is
+ * some, 0 if the time ran out.
+ */
+
+int transport_wait_readable (Transport *tpt, double seconds)
+{
+  struct exception e;
+  fd_set set;
+  struct timeval tv;
+  int ret;
+
+  if (tpt->fd == INVALID_TRANSPORT)
+    return 0;
+
+  FD_ZERO (&set);
+  FD_SET (tpt->fd,&set);
+
+  if (seconds < 0)
+    seconds = 0;
+  tv.tv_sec = (long) seconds;
+  tv.tv_usec = (long) ((seconds - tv.tv_sec) * 1e6);
+
+  ret = select (tpt->fd + 1, &set, 0, 0, &tv);
+  if (ret < 0 && sock_errno != EINTR)
+  {
+    e.errnum = sock_errno;
+    e.type = fatal;
+    Throw( e );
+  }
+  return (ret > 0);
+}
+
+/* wait up to a number of seconds for data to read on any of n transports.
+ * return the index of one that has some, -1 if the time ran out.
+ */
+
+int transport_wait_any (Transport **tpts, int n, double seconds)
+{
+  struct exception e;
+  fd_set set;
+  struct timeval tv;
+  int i, ret, maxfd = -1;
+
+  FD_ZERO (&set);
+  for (i = 0; i < n; i++)
+    if (tpts[i]->fd != INVALID_TRANSPORT)
+    {
+      FD_SET (tpts[i]->fd, &set);
+      if (tpts[i]->fd > maxfd)
+        maxfd = tpts[i]->fd;
+    }
+  if (maxfd < 0)
+    return -1;
+
+  if (seconds < 0)
+    seconds = 0;
+  tv.tv_sec = (long) seconds;
+  tv.tv_usec = (long) ((seconds - tv.tv_sec) * 1e6);
+
+  ret = select (maxfd + 1, &set, 0, 0, &tv);
+  if (ret < 0 && sock_errno != EINTR)
+  {
+    e.errnum = sock_errno;
+    e.type = fatal;
+    Throw( e );
+  }
+  for (i = 0; ret > 0 && i < n; i++)
+    if (tpts[i]->fd != INVALID_TRANSPORT && FD_ISSET (tpts[i]->fd, &set))
+      return i;
+  return -1;
+}
+
+/* give up on reads and writes that block for longer than ms (0 = never) */
+
+void transport_set_timeout (Transport *tpt, u32 ms)
+{
+  struct timeval tv;
+
+  if (tpt->fd == INVALID_TRANSPORT)
+    return;
+  tv.tv_sec = ms / 1000;
+  tv.tv_usec = (ms % 1000) * 1000;
+  setsockopt (tpt->fd, SOL_SOCKET, SO_RCVTIMEO, (char *) &tv, sizeof (tv));
+  setsockopt (tpt->fd, SOL_SOCKET, SO_SNDTIMEO, (char *) &tv, sizeof (tv));
+}
+
+/* have the kernel probe an idle connection, so a peer that vanished without
+ * closing it is noticed in idle + interval * count seconds rather than when
+ * the system's default timers run out. data left unacknowledged for that
+ * long also drops the connection, where TCP_USER_TIMEOUT is available.
+ */
+
+void transport_set_keepalive (Transport *tpt, u32 idle, u32 interval, u32 count)
+{
+  int on = (idle > 0);
+
+  if (tpt->fd == INVALID_TRANSPORT)
+    return;
+  setsockopt (tpt->fd, SOL_SOCKET, SO_KEEPALIVE, (char *) &on, sizeof (on));
+  if (!on)
+    return;
+#ifdef TCP_KEEPIDLE
+  {
+    int v = (int) idle;
+    setsockopt (tpt->fd, IPPROTO_TCP, TCP_KEEPIDLE, (char *) &v, sizeof (v));
+    v = (int) interval;
+    setsockopt (tpt->fd, IPPROTO_TCP, TCP_KEEPINTVL, (char *) &v, sizeof (v));
+    v = (int) count;
+    setsockopt (tpt->fd, IPPROTO_TCP, TCP_KEEPCNT, (char *) &v, sizeof (v));
+  }
+#endif
+#ifdef TCP_USER_TIMEOUT
+  {
+    unsigned int ms = (idle + interval * count) * 1000;
+    setsockopt (tpt->fd, IPPROTO_TCP, TCP_USER_TIMEOUT, (char *) &ms, sizeof (ms));
+  }
+#endif
+}
+
 /* see if there is any data to read from a socket, without actually reading
  * it. return 1 if data is available, on 0 if not. if this is a listening
  * socket this returns 1 if a connection is available or 0 if not.
@@ -218,3 +218,21 @@ int ser_readable( ser_handler id )
 
   return ( ret > 0 );
 }
+
+// Wait up to timeout ms for data, return 1 if there is some
+int ser_wait_readable( ser_handler id, u32 timeout )
+{
+  fd_set rdfs;
+  int ret;
+  struct timeval tv;
+
+  FD_ZERO( &rdfs );
+  FD_SET( id, &rdfs );
+  tv.tv_sec = timeout / 1000;
+  tv.tv_usec = ( timeout % 1000 ) * 1000;
+
+  ret = select( id + 1, &rdfs, NULL, NULL, &tv );
+  if( ret < 0 )
+    return ret;
+  return ( ret > 0 );
+}
@@ -157,3 +157,17 @@ int ser_readable( ser_handler id )
   
   return ( comStat.cbInQue > 0 );
 }
+
+// Wait up to timeout ms for data, return 1 if there is some
+int ser_wait_readable( ser_handler id, u32 timeout )
+{
+  DWORD start = GetTickCount();
+
+  while( !ser_readable( id ) )
+  {
+    if( GetTickCount() - start >= timeout )
+      return 0;
+    Sleep( 1 );
+  }
+  return 1;
+}
@@ -37,6 +37,7 @@ print("Done 42")
 assert(slave.mirror("The quick brown fox jumps over the lazy dog") == "The quick brown fox jumps over the lazy dog", "string return failed")
 -- print(slave.mirror(squareval))
 assert(slave.mirror(true) == true, "function return failed")
+assert(slave.mirror_with_a_rather_long_generated_name(42) == 42, "long function name call failed")
 
 -- basic remote call with returned data
 assert( slave.foo1 (123,56,"hello") == 456, "basic call and return failed" )
@@ -53,6 +54,85 @@ assert(test_local.sval == slave.test:get().sval, "table field not equivalent")
 slave.yarg.blurg = 23
 assert(slave.yarg.blurg:get() == 23, "not equal")
 
+-- lazy proxies fetch only what is touched
+big = slave.bigtable:proxy()
+assert(big[10] == 100, "proxy index failed")
+assert(big.name == "squares", "proxy string index failed")
+assert(big.missing == nil, "proxy missing field not nil")
+assert(#big == 1000, "proxy length failed")
+n = 0
+for k,v in rpc.pairs(big) do n = n + 1 end
+assert(n == 1001, "proxy traversal failed")
+
+-- streams arrive in chunks, with other commands allowed in between
+parts = {}
+for chunk in slave.dump_log:stream(10000) do
+  assert(#chunk <= 10000, "stream chunk too large")
+  assert(slave.mirror(1) == 1, "call between chunks failed")
+  parts[#parts + 1] = chunk
+end
+assert(table.concat(parts) == string.rep("0123456789abcdef", 16384), "string stream failed")
+n = 0
+for chunk in slave.bigtable:stream(100) do
+  for k,v in pairs(chunk) do n = n + 1 end
+end
+assert(n == 1001, "table stream failed")
+
+-- blobs are sent straight from files and arrive as strings
+f = io.open("blob-test.tmp", "wb")
+f:write(string.rep("blob", 1000))
+f:close()
+assert(slave.mirror(rpc.file_blob("blob-test.tmp", 4, 8)) == "blobblob", "blob transfer failed")
+assert(#slave.mirror(rpc.file_blob("blob-test.tmp")) == 4000, "whole file blob failed")
+os.remove("blob-test.tmp")
+
+-- arrays of numbers are sent packed
+squares = {}
+for i=1,1000 do squares[i] = i*i end
+squares = slave.mirror(squares)
+assert(#squares == 1000 and squares[1000] == 1000000, "packed array failed")
+mixed = slave.mirror({1, 2, 3, 4, n = 5})
+assert(mixed.n == 5 and #mixed == 4, "mixed table sent as array")
+
+-- values can be encoded without a connection
+coded = rpc.decode(rpc.encode({1, 2, 3, 4, s = "str", t = {true}}))
+assert(coded[4] == 4 and coded.s == "str" and coded.t[1] == true, "encode/decode failed")
+assert(rpc.decode(rpc.encode(12345.5, {little = false})) == 12345.5, "byte swapped encoding failed")
+assert(not pcall(rpc.decode, "LRPC"), "truncated value decoded")
+
+-- connections keep counters
+stats = rpc.stats(slave)
+assert(stats.calls > 0 and stats.connects == 1 and stats.bytes_out > 0, "stats not counted")
+
+-- deadlines travel with the call
+assert(slave.mirror:with_deadline(5000)(42) == 42, "call with deadline failed")
+assert(slave.budget:with_deadline(5000)() > 0, "deadline not sent")
+assert(slave.budget() == nil, "deadline on a plain call")
+
+-- the server answers heartbeats
+assert(rpc.ping(slave) >= 0, "ping failed")
+rpc.heartbeat(slave, 0.01)
+rpc.sleep(0.02)
+assert(slave.mirror(10) == 10, "call after heartbeat failed")
+assert(rpc.stats(slave).pings == 2, "heartbeat not sent")
+rpc.heartbeat(slave, nil)
+
+-- calls can be collected later or cancelled
+f = slave.mirror:async(7)
+assert(not pcall(slave.mirror, 8), "command sent with a call outstanding")
+assert(f:wait() == 7, "future returned wrong value")
+slave.until_cancelled:async(10):cancel()
+assert(not pcall(slave.until_cancelled:with_deadline(100), 10), "deadline not enforced")
+assert(slave.mirror(9) == 9, "cancelled reply not skipped")
+assert(rpc.stats(slave).cancels == 2, "cancels not counted")
+
+-- cached gets are revalidated, and see our own assignments
+rpc.cache(slave, 10, "validate")
+assert(slave.test:get() == slave.test:get(), "get not cached")
+slave.yarg.blurg = 24
+assert(slave.yarg.blurg:get() == 24, "stale cached get")
+rpc.cache(slave, nil)
+
 -- function assigment
 slave.squareval = squareval
 assert(type(slave.squareval) == "userdata", "function assigment failed")
@@ -78,9 +158,161 @@ for idx,val in ipairs(a) do
   assert(val.x:get() == tval, "missing parent helper")
 end
 
+-- repeated indexing returns the same helper, so natural-style loops don't
+-- allocate a userdata per index
+assert(slave.y.z == slave.y.z, "helpers not memoized")
+
+collectgarbage("collect")
+collectgarbage("stop")
+kb = collectgarbage("count")
+for i=1,10000 do
+  local h = slave.y.z.x
+end
+-- a helper per index would be several hundred KB
+assert(collectgarbage("count") - kb < 64, "helper indexing allocates")
+collectgarbage("restart")
+
 slave.y.z.asdasd = squareval
 
 print('trying slave.x.asd.blarg()')
 slave.y.z.asdasd(2)
 
+-- events published on a subscribed topic are pushed and delivered by step
+local news = {}
+rpc.subscribe(slave, "news", function(value, topic) news[#news + 1] = value end)
+assert(slave.announce("news", "first"), "publish to subscriber failed")
+assert(not slave.announce("weather", 1), "published to an unsubscribed topic")
+assert(rpc.step(slave, 1) == 1 and news[1] == "first", "pushed event not delivered")
+rpc.unsubscribe(slave, "news")
+assert(not slave.announce("news", "second"), "published after unsubscribing")
+
+-- a watch is told of assignments to its path, inside it or above it
+local limits = {}
+slave.watched:watch(function(value, path) limits[#limits + 1] = value end)
+slave.watched = {max = 1}
+slave.watched.max = 2
+slave.set_watched_max(3)
+assert(rpc.step(slave, 1) == 3, "watch notifications not delivered")
+assert(limits[1].max == 1 and limits[2].max == 2 and limits[3].max == 3,
+       "watch notifications out of order")
+slave.watched:unwatch()
+slave.watched.max = 4
+assert(rpc.step(slave, 0.1) == 0, "notified after unwatching")
+
+-- the server keeps call times by function, until they are reset
+slave.served_calls("mirror", true)
+for i=1,3 do slave.mirror(i) end
+local calls, median = slave.served_calls("mirror", true)
+assert(calls == 3 and median >= 0, "served calls not counted")
+assert(slave.served_calls("mirror") == 0, "function stats not reset")
+
+-- calls over the threshold are logged with where they came from
+slave.log_slow_calls(0.05)
+slave.nap(0.1)
+local path, peer = slave.last_slow_call()
+slave.log_slow_calls(nil)
+assert(path == "nap", "slow call not logged")
+if rpc.mode == "tcpip" then
+    assert(peer:match("^127%.0%.0%.1:%d+$"), "slow call peer wrong")
+else
+    assert(peer == "serial", "slow call peer wrong")
+end
+
+-- a reconnecting handle reopens a connection the server dropped, and its
+-- helpers keep working. the call that finds it dropped fails.
+if rpc.mode == "tcpip" then
+    local mirror = slave.mirror
+    rpc.reconnect(slave, true)
+    slave.set_idle_timeout(0.1)
+    rpc.sleep(0.3)
+    assert(not pcall(mirror, 1), "call on a dropped connection succeeded")
+    assert(mirror(2) == 2, "call after reconnect failed")
+    assert(rpc.stats(slave).reconnects == 1, "reconnect not counted")
+    slave.set_idle_timeout(nil)
+end
+
 rpc.close (slave)
+
+-- a pool sends each call on an idle connection. the test server takes one
+-- connection at a time, so the pool only gets one.
+if rpc.mode == "tcpip" then
+    pool = rpc.pool ("localhost", 12346, {size = 1});
+else
+    pool = rpc.pool ("/dev/ttys0", {size = 1});
+end
+assert(pool.mirror(5) == 5, "call through pool failed")
+pool.yarg.pooled = 6
+assert(pool.yarg.pooled:get() == 6, "assignment through pool failed")
+f = pool.mirror:async(7)
+assert(not pcall(pool.mirror, 8), "busy pool connection reused")
+assert(f:wait() == 7, "future from pool failed")
+rpc.close (pool)
+
+-- a group spreads calls over replicas, here only the one
+if rpc.mode == "tcpip" then
+    group = rpc.connect_group ({{"localhost", 12346}}, {policy = "least"});
+else
+    group = rpc.connect_group ({"/dev/ttys0"}, {policy = "least"});
+end
+assert(group.mirror(3) == 3, "call through group failed")
+assert(group.mirror:hedged()(4) == 4, "hedged call through group failed")
+assert(not pcall(slave.mirror.hedged, slave.mirror), "hedged call without a group")
+assert(rpc.endpoints(group)[1].latency > 0, "group latency not measured")
+rpc.close (group)
+
+-- groups of two replicas. these run when a second server is listening,
+-- started with: lua test-server.lua 12356
+local replicas = {{"localhost", 12346}, {"localhost", 12356}}
+local second_server = false
+if rpc.mode == "tcpip" then
+    group = rpc.connect_group (replicas, {policy = "round_robin"});
+    second_server = not rpc.endpoints(group)[2].ejected
+    if not second_server then
+        print("no server on port 12356, skipping the tests of two replicas")
+        rpc.close (group)
+    end
+end
+if second_server then
+    assert(group.which_port() ~= group.which_port(), "round robin chose one replica")
+
+    -- after 10 calls to each, a slow call is hedged on the other replica,
+    -- and the slow one cancelled
+    for i=1,18 do group.which_port() end
+    assert(group.stall_on:hedged()(12346, 5) == 12356, "slow call not hedged")
+    local eps = rpc.endpoints(group)
+    assert(eps[2].hedges == 1 and eps[2].hedge_wins == 1, "hedge not counted")
+    local t = rpc.clock()
+    assert(group.which_port() == 12346, "round robin out of turn")
+    assert(rpc.clock() - t < 1, "losing hedged call not cancelled")
+    assert(not pcall(group.until_cancelled:hedged():with_deadline(200), 5) and
+           rpc.clock() - t < 1, "hedged call ran past its deadline")
+    rpc.close (group)
+
+    -- the busy replica is passed over
+    for _, policy in ipairs({"least", "p2c"}) do
+        group = rpc.connect_group (replicas, {policy = policy});
+        f = group.which_port:async()
+        assert(group.which_port() ~= f:wait(), policy .. " chose a busy replica")
+        rpc.close (group)
+    end
+
+    -- a replica that can't be reached is ejected
+    group = rpc.connect_group ({replicas[1], {"localhost", 12349}}, {policy = "round_robin"});
+    for i=1,4 do
+        assert(group.which_port() == 12346, "call sent to an unreachable replica")
+    end
+    assert(rpc.endpoints(group)[2].ejected, "unreachable replica not ejected")
+    rpc.close (group)
+end
+
+-- a sharded group routes each call by its key, here to the only shard
+if rpc.mode == "tcpip" then
+    shards = rpc.connect_group ({{"localhost", 12346}}, {policy = "jump"});
+else
+    shards = rpc.connect_group ({"/dev/ttys0"}, {policy = "jump"});
+end
+assert(shards.mirror("key") == "key", "call through sharded group failed")
+assert(not pcall(shards.mirror), "sharded call without a key")
+local doubled = shards.double_keys:fanout({"a", "b"})
+assert(doubled.a == "aa" and doubled.b == "bb", "fanout failed")
+rpc.close (shards)
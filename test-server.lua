@@ -36,9 +36,82 @@ function mirror( input )
 	return input
 end
 
+function mirror_with_a_rather_long_generated_name( input )
+	return input
+end
+
+function budget()
+	return rpc.remaining()
+end
+
+function double_keys( keys )
+	local t = {}
+	for _, k in ipairs(keys) do t[k] = k .. k end
+	return t
+end
+
+function announce( topic, value )
+	return rpc.publish(server, topic, value)
+end
+
+function set_watched_max( value )
+	rpc.set(server, "watched.max", value)
+end
+
+-- how many calls of fname have been served, and their median time
+function served_calls( fname, reset )
+	local st = rpc.function_stats(server, reset)[fname]
+	if st then return st.calls, st.call.p50_us end
+	return 0
+end
+
+function log_slow_calls( threshold )
+	rpc.slow_log(server, threshold)
+end
+
+-- the path and peer of the latest slow call
+function last_slow_call()
+	local calls = rpc.slow_calls(server)
+	local c = calls[#calls]
+	if c then return c.path, c.peer end
+end
+
+function nap( seconds )
+	rpc.sleep(seconds)
+	return seconds
+end
+
+function set_idle_timeout( seconds )
+	rpc.idle_timeout(server, seconds)
+end
+
+function until_cancelled( seconds )
+	local stop = rpc.clock() + seconds
+	while rpc.clock() < stop do
+		if rpc.cancelled() then return "cancelled" end
+	end
+	return "finished"
+end
+
+function which_port()
+	return port
+end
+
+-- slow on one replica of a group, so a hedged call goes to the other
+function stall_on( stalled, seconds )
+	if port == stalled then until_cancelled(seconds) end
+	return port
+end
+
 
 yarg = {}
 
+bigtable = {}
+for i=1,1000 do bigtable[i] = i*i end
+bigtable.name = "squares"
+
+dump_log = string.rep("0123456789abcdef", 16384)
+
 test = {1, 2, 3, 4, "234"}
 
 test.sval = 23
@@ -49,13 +122,20 @@ io.write ("server started\n")
 -- rpc.server ("/dev/ptys0"); -- use for serial mode
 -- rpc.server ("/dev/ptmx"); -- use for serial mode
 
+-- the client's group tests want a second server: lua test-server.lua 12356
+port = tonumber(arg and arg[1]) or 12346
+
+-- listen rather than rpc.server, so announce() has the handle to publish on
 if rpc.mode == "tcpip" then
   io.write("TCP/IP Server Started\n")
-  rpc.server(12346);
+  server = rpc.listen(port);
 elseif rpc.mode == "serial" then
   io.write("Serial Server Started\n")
-  rpc.server("/dev/ptys0");
+  server = rpc.listen("/dev/ptys0");
 end
+repeat
+  rpc.dispatch (server)
+until rpc.peek (server) == 0
 
 -- an alternative way
 
@@ -0,0 +1,242 @@
+-- LuaRPC load generator
+--
+--   lua tools/loadgen.lua [options] target [target ...]
+--
+-- a target is host:port in tcpip mode or a device in serial mode. each
+-- worker is a separate process with its own connection, given targets in
+-- turn, so several server processes can be loaded at once. note that a
+-- luarpc server serves one connection at a time; more workers than servers
+-- measures how long clients queue for a connection.
+--
+-- options:
+--   --workers n        connections, each with one call outstanding (4)
+--   --duration s       seconds measured (10)
+--   --warmup s         seconds run before measuring (1)
+--   --rate r           open loop: start r requests/sec in total instead of
+--                      starting the next one as soon as the last returns
+--   --interval s       closed loop: expected time between requests, used to
+--                      correct for coordinated omission (default: the
+--                      worker's median latency)
+--   --mix m            operation weights (call=8,get=1,newindex=1)
+--   --call name        function called with one string argument (mirror)
+--   --get name         variable fetched with get() (test)
+--   --set name         variable assigned a counter (yarg.loadgen)
+--   --histogram        print the latency histograms
+--
+-- the defaults suit test-server.lua. latencies are reported as measured and
+-- corrected for coordinated omission: in open loop mode each request is
+-- timed from when it should have started, in closed loop mode requests that
+-- stalled longer than the interval are backfilled with the ones that would
+-- have been waiting behind them.
+
+require("rpc")
+
+local options = {
+	workers = 4, duration = 10, warmup = 1, mix = "call=8,get=1,newindex=1",
+	call = "mirror", get = "test", set = "yarg.loadgen",
+}
+local targets = {}
+
+local i = 1
+while arg[i] do
+	local name = arg[i]:match("^%-%-(.+)")
+	if name == "histogram" or name == "worker" then
+		options[name] = true
+	elseif name then
+		i = i + 1
+		options[name] = arg[i]
+	else
+		targets[#targets + 1] = arg[i]
+	end
+	i = i + 1
+end
+
+-- histograms
+--   buckets are exact below 16us, then 16 per power of two, so every bucket
+--   is within about 6% of the values in it
+
+local function bucket(us)
+	if us < 16 then return math.floor(us) end
+	local e = math.floor(math.log(us) / math.log(2))
+	return (e - 3) * 16 + math.floor(us / 2 ^ (e - 4)) - 16
+end
+
+local function bucket_value(b)
+	if b < 16 then return b end
+	return (b % 16 + 16) * 2 ^ (math.floor(b / 16) - 1)
+end
+
+local function record(h, seconds, count)
+	local b = bucket(seconds * 1e6)
+	h[b] = (h[b] or 0) + (count or 1)
+end
+
+local function summary(h)
+	local keys, total = {}, 0
+	for b, n in pairs(h) do
+		keys[#keys + 1] = b
+		total = total + n
+	end
+	table.sort(keys)
+	local s, seen, want = {}, 0, { 0.5, 0.9, 0.99, 0.999, 0.9999 }
+	for _, b in ipairs(keys) do
+		seen = seen + h[b]
+		while want[1] and seen >= want[1] * total do
+			s[#s + 1] = string.format("p%g=%.0fus", want[1] * 100, bucket_value(b))
+			table.remove(want, 1)
+		end
+	end
+	if keys[1] then
+		s[#s + 1] = string.format("max=%.0fus", bucket_value(keys[#keys]))
+	end
+	return table.concat(s, " "), keys
+end
+
+-- worker: run operations against one target and print the histograms
+
+local function connect(target)
+	if rpc.mode == "tcpip" then
+		local host, port = target:match("^(.*):(%d+)$")
+		return rpc.connect(host, tonumber(port))
+	end
+	return rpc.connect(target)
+end
+
+local function resolve(helper, path)
+	for name in path:gmatch("[^%.]+") do helper = helper[name] end
+	return helper
+end
+
+local function worker()
+	local slave = assert(connect(targets[1]))
+	local ops, weights = {}, 0
+	local counter = 0
+	local parent, field = options.set:match("^(.-)%.?([^%.]+)$")
+	local target = parent == "" and slave or resolve(slave, parent)
+	local run = {
+		call = function() resolve(slave, options.call)("loadgen") end,
+		get = function() resolve(slave, options.get):get() end,
+		newindex = function() counter = counter + 1; target[field] = counter end,
+	}
+	for op, w in options.mix:gmatch("(%w+)=(%d+)") do
+		assert(run[op], "unknown operation " .. op)
+		weights = weights + w
+		ops[#ops + 1] = { weights, run[op] }
+	end
+	local function pick()
+		local r = math.random() * weights
+		for _, o in ipairs(ops) do
+			if r < o[1] then return o[2] end
+		end
+		return ops[#ops][2]
+	end
+
+	local measured, corrected, latencies = {}, {}, {}
+	local count, errors = 0, 0
+	local interval = options.rate and tonumber(options.workers) / tonumber(options.rate)
+	local start = rpc.clock()
+	local measure_from = start + tonumber(options.warmup)
+	local stop = measure_from + tonumber(options.duration)
+	local due = start + (interval or 0) * (tonumber(options.seed) - 1) / tonumber(options.workers)
+
+	while true do
+		if interval then
+			rpc.sleep(due - rpc.clock())
+		end
+		local t = rpc.clock()
+		if t >= stop then break end
+		if not pcall(pick()) then errors = errors + 1 end
+		local now = rpc.clock()
+		if t >= measure_from then
+			count = count + 1
+			record(measured, now - t)
+			if interval then
+				record(corrected, now - due)
+			else
+				latencies[#latencies + 1] = now - t
+			end
+		end
+		if interval then due = due + interval end
+	end
+
+	-- closed loop correction: a request that took longer than the expected
+	-- interval held back the ones that would have started meanwhile
+	if not interval and #latencies > 0 then
+		interval = tonumber(options.interval)
+		if not interval then
+			table.sort(latencies)
+			interval = latencies[math.ceil(#latencies / 2)]
+		end
+		for _, l in ipairs(latencies) do
+			record(corrected, l)
+			local missed = l - interval
+			while interval > 0 and missed > 0 do
+				record(corrected, missed)
+				missed = missed - interval
+			end
+		end
+	end
+
+	print("count", count, errors)
+	for b, n in pairs(measured) do print("measured", b, n) end
+	for b, n in pairs(corrected) do print("corrected", b, n) end
+	rpc.close(slave)
+end
+
+if options.worker then
+	math.randomseed(os.time() + tonumber(options.seed or 0))
+	worker()
+	return
+end
+
+-- master: start the workers and merge what they report
+
+assert(#targets > 0, "usage: lua tools/loadgen.lua [options] target [target ...]")
+
+local lua = arg[-1] or "lua"
+local script = arg[0]
+local pass = {}
+for _, name in ipairs({ "workers", "duration", "warmup", "rate", "interval", "mix", "call", "get", "set" }) do
+	if options[name] then
+		pass[#pass + 1] = string.format("--%s %q", name, tostring(options[name]))
+	end
+end
+pass = table.concat(pass, " ")
+
+local pipes = {}
+for w = 1, tonumber(options.workers) do
+	local target = targets[(w - 1) % #targets + 1]
+	pipes[w] = io.popen(string.format("%s %q --worker --seed %d %s %q",
+		lua, script, w, pass, target))
+end
+
+local measured, corrected = {}, {}
+local count, errors = 0, 0
+for _, p in ipairs(pipes) do
+	for line in p:lines() do
+		local kind, a, b = line:match("^(%a+)%s+(%S+)%s+(%S+)")
+		if kind == "count" then
+			count, errors = count + a, errors + b
+		elseif kind == "measured" then
+			measured[tonumber(a)] = (measured[tonumber(a)] or 0) + b
+		elseif kind == "corrected" then
+			corrected[tonumber(a)] = (corrected[tonumber(a)] or 0) + b
+		end
+	end
+	p:close()
+end
+
+local duration = tonumber(options.duration)
+print(string.format("%s loop, %d workers, %d targets, %gs",
+	options.rate and "open" or "closed", options.workers, #targets, duration))
+print(string.format("requests %d (%.1f/s), errors %d", count, count / duration, errors))
+
+for _, h in ipairs({ { "measured", measured }, { "corrected", corrected } }) do
+	local s, keys = summary(h[2])
+	print(string.format("%-10s %s", h[1], s))
+	if options.histogram then
+		for _, b in ipairs(keys) do
+			print(string.format("  %10.0fus %d", bucket_value(b), h[2][b]))
+		end
+	end
+end